@@ -13,8 +13,16 @@
 #include <vector>
 #include <algorithm>
 #include <iomanip>
-#include "newimage/fmribmain.h"
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <mutex>
+#include <memory>
 #include "newimage/newimageall.h"
+#include "newimage/fmribmain.h"
 #include "utils/options.h"
 #include "infer.h"
 #include "warpfns/warpfns.h"
@@ -33,7 +41,7 @@ using namespace MISCMATHS;
 using namespace NEWIMAGE;
 
 string title="cluster \nCopyright(c) 2000-2013, University of Oxford (Mark Jenkinson, Matthew Webster)";
-string examples="cluster --in=<filename> --thresh=<value> [options]";
+string examples="cluster --in=<filename> --thresh=<value> [options]\n\tcluster --in=<filename> --threshlist=<values> [options]\n\tcluster --batch=<manifest> --thresh=<value> [options]\n\tcluster --in=<filename> --tfce --otfce=<filename> [options]";
 
 Option<bool> verbose(string("-v,--verbose"), false,
 		     string("switch on diagnostic messages"),
@@ -47,6 +55,9 @@ Option<bool> mm(string("--mm"), false,
 Option<bool> minv(string("--min"), false,
 		  string("find minima instead of maxima"),
 		  false, no_argument);
+Option<bool> twotailedmode(string("--twotailed"), false,
+		       string("find positive clusters above the threshold and, in the same pass, negative ones below minus the threshold, which get negative indices"),
+		       false, no_argument);
 Option<bool> fractional(string("--fractional"), false,
 			string("interprets the threshold as a fraction of the robust range"),
 			false, no_argument);
@@ -82,7 +93,10 @@ Option<float> resels(string("-r,--resels"), -1,
       false, requires_argument);
 Option<float> thresh(string("-t,--thresh,--zthresh"), 2.3,
 		     string("threshold for input volume"),
-		     true, requires_argument);
+		     false, requires_argument);
+Option<string> threshlist(string("--threshlist"), string(""),
+		     string("comma-separated thresholds and/or start:step:stop ranges; prints one cluster table per threshold"),
+		     false, requires_argument);
 Option<float> pthresh(string("-p,--pthresh"), 0.01,
 		      string("p-threshold"),
 		      false, requires_argument);
@@ -90,11 +104,17 @@ Option<float> peakdist(string("--peakdist"), 0,
 		      string("minimum distance between local maxima/minima, in mm (default 0)"),
 		      false, requires_argument);
 Option<string> inputname(string("-i,--in,-z,--zstat"), string(""),
-			 string("filename of input volume"),
-			 true, requires_argument);
+			 string("filename of input volume; each volume of a 4D image (and of a matching 4D --cope) is clustered in turn"),
+			 false, requires_argument);
 Option<string> copename(string("-c,--cope"), string(""),
 			string("filename of input cope volume"),
 			false, requires_argument);
+Option<vector<float> > roibox(string("--roi"), vector<float>(),
+			      string("only read and cluster the block x0,x1,y0,y1,z0,z1 of the input, in voxel (or, with --mm, mm) coordinates; tables and maps stay in the space of the whole image"),
+			      false, requires_argument);
+Option<string> roimask(string("--roimask"), string(""),
+		       string("only cluster the nonzero voxels of this mask, reading just their bounding box of the input (and cope) image"),
+		       false, requires_argument);
 Option<string> outpvals(string("--opvals"), string(""),
 			string("filename for image output of log pvals"),
 			false, requires_argument);
@@ -134,6 +154,32 @@ Option<string> scalarname(string("--scalarname"), string(""),
 Option<string> empirical(string("--empiricalNull"), string(""),
 			 string("Use a (1-p) input image to calculate p-values and cluster-map"),
 		       false, requires_argument);
+Option<string> batchname(string("--batch"), string(""),
+			 string("filename of manifest, one image per line given as --in=, --cope=, --empiricalNull=, output options and --otable= (file for the table)"),
+		       false, requires_argument);
+Option<int> nthreads(string("--nthr"), 1,
+		     string("number of threads, used for the --batch images, the volumes of a 4D input, the --nullstack volumes, the TFCE sums or else for transforming coordinates (default 1)"),
+		     false, requires_argument);
+Option<string> nullstack(string("--nullstack"), string(""),
+			 string("4D image of permuted or simulated statistic maps: clusters get FWE-corrected p-values from the null of the maximum cluster size and mass"),
+		       false, requires_argument);
+Option<bool> tfcemode(string("--tfce"), false,
+		      string("threshold-free cluster enhancement: write the TFCE image of the input to --otfce instead of clustering"),
+		      false, no_argument);
+Option<string> outtfce(string("--otfce"), string(""),
+		       string("filename for output of TFCE image"),
+		       false, requires_argument);
+Option<float> tfceH(string("--tfce_H"), 2.0,
+		    string("TFCE height power (default 2)"),
+		    false, requires_argument);
+Option<float> tfceE(string("--tfce_E"), 0.5,
+		    string("TFCE extent power (default 0.5)"),
+		    false, requires_argument);
+Option<float> tfceDh(string("--tfce_dh"), 0,
+		     string("TFCE height step (default 0: 1/100 of the image maximum)"),
+		     false, requires_argument);
+
+int64_t nInputVolumes(1);   // volumes of the --in image, a 4D one is clustered volume by volume
 
 int num(const char x) { return (int) x; }
 short int num(const short int x) { return x; }
@@ -156,15 +202,21 @@ int originalLabel;
 unsigned int size;
 T maxval;
 float meanval;
+float mass;      //sum of the values
+float masspval;  //FWE-corrected p-value of the mass (--nullstack only)
 triple<float> maxpos; //float as may be mm or vox
 triple<float> cog;
+triple<int> bbmin; //bounding box in voxels
+triple<int> bbmax;
 float pval;
 float logpval;
+bool negative;   //cluster of the negative tail (--twotailed only)
 };
 
 template <class T>
-cluster<T>::cluster() : originalLabel(0), size(0), maxval(0), meanval(0), pval(1),logpval(0) {
+cluster<T>::cluster() : originalLabel(0), size(0), maxval(0), meanval(0), mass(0), masspval(1), pval(1),logpval(0), negative(false) {
   maxpos.x=maxpos.y=maxpos.z=cog.x=cog.y=cog.z=0;
+  bbmin.x=bbmin.y=bbmin.z=bbmax.x=bbmax.y=bbmax.z=0;
 }
 
 template <class T>
@@ -203,149 +255,795 @@ void MultiplyCoordinateVector(triple<T> & coords, const Matrix& mat)
   coords.z = vec(3);
 }
 
+// Transforms all the coordinates in one batched call, sharing the set-up
 template <class T, class S>
-void TransformToReference(triple<T> & coordlist, const Matrix& affine,
+void TransformToReference(const vector<triple<T>*>& coordlist, const Matrix& affine,
 			  const volume<S>& source, const volume<S>& dest, const volume4D<float>& warp,bool doAffineTransform, bool doWarpfieldTransform)
 {
-  ColumnVector coord(4);
-  coord << coordlist.x << coordlist.y << coordlist.z << 1.0;
-  if ( doAffineTransform && doWarpfieldTransform ) coord = NewimageCoord2NewimageCoord(affine,warp,true,source,dest,coord);
-  if ( doAffineTransform && !doWarpfieldTransform) coord = NewimageCoord2NewimageCoord(affine,source,dest,coord);
-  if ( !doAffineTransform && doWarpfieldTransform) coord = NewimageCoord2NewimageCoord(warp,true,source,dest,coord);
-  coordlist.x = coord(1);
-  coordlist.y = coord(2);
-  coordlist.z = coord(3);
+  vector<double> coords(3*coordlist.size());
+  for (unsigned int n=0; n<coordlist.size(); n++) {
+    coords[3*n]=coordlist[n]->x;
+    coords[3*n+1]=coordlist[n]->y;
+    coords[3*n+2]=coordlist[n]->z;
+  }
+  // --batch images and the volumes of a 4D input are already processed in parallel
+  NoOfThreads nthr((batchname.set() || nInputVolumes>1) ? 1 : nthreads.value());
+  if ( doAffineTransform && doWarpfieldTransform ) NewimageCoord2NewimageCoord(affine,warp,true,source,dest,coords.data(),coords.data(),coordlist.size(),nthr);
+  if ( doAffineTransform && !doWarpfieldTransform) NewimageCoord2NewimageCoord(affine,source,dest,coords.data(),coords.data(),coordlist.size(),nthr);
+  if ( !doAffineTransform && doWarpfieldTransform) NewimageCoord2NewimageCoord(warp,true,source,dest,coords.data(),coords.data(),coordlist.size(),nthr);
+  for (unsigned int n=0; n<coordlist.size(); n++) {
+    coordlist[n]->x = coords[3*n];
+    coordlist[n]->y = coords[3*n+1];
+    coordlist[n]->z = coords[3*n+2];
+  }
+}
+
+// Running statistics of one (provisional) label, merged when labels are joined
+template <class T>
+struct labelStats {
+labelStats() : size(0), maxval(0), maxidx(-1), sum(0), cogx(0), cogy(0), cogz(0) {}
+void add(const T val, const int64_t idx, const int x, const int y, const int z, const bool minv);
+void merge(const labelStats<T>& other, const bool minv);
+unsigned int size;
+T maxval;
+int64_t maxidx; //raster index of the extremum, earliest one on ties
+double sum, cogx, cogy, cogz;
+triple<int> bbmin, bbmax;
+};
+
+template <class T>
+void labelStats<T>::add(const T val, const int64_t idx, const int x, const int y, const int z, const bool minv)
+{
+  if (size++==0) {
+    bbmin=bbmax=triple<int>(x,y,z);
+  } else {
+    bbmin.x=Min(bbmin.x,x); bbmax.x=Max(bbmax.x,x);
+    bbmin.y=Min(bbmin.y,y); bbmax.y=Max(bbmax.y,y);
+    bbmin.z=Min(bbmin.z,z); bbmax.z=Max(bbmax.z,z);
+  }
+  sum+=(double) val;
+  cogx+=((double) val)*x;
+  cogy+=((double) val)*y;
+  cogz+=((double) val)*z;
+  if ((maxidx<0) || ((val>maxval) && !minv) || ((val<maxval) && minv) ||
+      ((val==maxval) && (idx<maxidx))) {
+    maxval=val;
+    maxidx=idx;
+  }
 }
 
 template <class T>
-bool checkIfLocalMaxima(const int& index, const volume<int>& labelim, const volume<T>& zvol, const int& connectivity, const int& x, const int& y, const int& z )
+void labelStats<T>::merge(const labelStats<T>& other, const bool minv)
 {
-  if (connectivity==6)
-    return ( index==labelim(x,y,z) &&
-	     zvol(x,y,z)>zvol(x,  y,  z-1) &&
-	     zvol(x,y,z)>zvol(x,  y-1,z) &&
-	     zvol(x,y,z)>zvol(x-1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x+1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x,  y+1,z) &&
-	     zvol(x,y,z)>=zvol(x,  y,  z+1) );
+  if (other.size==0) return;
+  if (size==0) { *this=other; return; }
+  size+=other.size;
+  bbmin.x=Min(bbmin.x,other.bbmin.x); bbmax.x=Max(bbmax.x,other.bbmax.x);
+  bbmin.y=Min(bbmin.y,other.bbmin.y); bbmax.y=Max(bbmax.y,other.bbmax.y);
+  bbmin.z=Min(bbmin.z,other.bbmin.z); bbmax.z=Max(bbmax.z,other.bbmax.z);
+  sum+=other.sum;
+  cogx+=other.cogx;
+  cogy+=other.cogy;
+  cogz+=other.cogz;
+  if (((other.maxval>maxval) && !minv) || ((other.maxval<maxval) && minv) ||
+      ((other.maxval==maxval) && (other.maxidx<maxidx))) {
+    maxval=other.maxval;
+    maxidx=other.maxidx;
+  }
+}
 
-  else
-    return ( index==labelim(x,y,z) &&
-	     zvol(x,y,z)>zvol(x-1,y-1,z-1) &&
-	     zvol(x,y,z)>zvol(x,  y-1,z-1) &&
-	     zvol(x,y,z)>zvol(x+1,y-1,z-1) &&
-	     zvol(x,y,z)>zvol(x-1,y,  z-1) &&
-	     zvol(x,y,z)>zvol(x,  y,  z-1) &&
-	     zvol(x,y,z)>zvol(x+1,y,  z-1) &&
-	     zvol(x,y,z)>zvol(x-1,y+1,z-1) &&
-	     zvol(x,y,z)>zvol(x,  y+1,z-1) &&
-	     zvol(x,y,z)>zvol(x+1,y+1,z-1) &&
-	     zvol(x,y,z)>zvol(x-1,y-1,z) &&
-	     zvol(x,y,z)>zvol(x,  y-1,z) &&
-	     zvol(x,y,z)>zvol(x+1,y-1,z) &&
-	     zvol(x,y,z)>zvol(x-1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x+1,y,  z) &&
-	     zvol(x,y,z)>=zvol(x-1,y+1,z) &&
-	     zvol(x,y,z)>=zvol(x,  y+1,z) &&
-	     zvol(x,y,z)>=zvol(x+1,y+1,z) &&
-	     zvol(x,y,z)>=zvol(x-1,y-1,z+1) &&
-	     zvol(x,y,z)>=zvol(x,  y-1,z+1) &&
-	     zvol(x,y,z)>=zvol(x+1,y-1,z+1) &&
-	     zvol(x,y,z)>=zvol(x-1,y,  z+1) &&
-	     zvol(x,y,z)>=zvol(x,  y,  z+1) &&
-	     zvol(x,y,z)>=zvol(x+1,y,  z+1) &&
-	     zvol(x,y,z)>=zvol(x-1,y+1,z+1) &&
-	     zvol(x,y,z)>=zvol(x,  y+1,z+1) &&
-	     zvol(x,y,z)>=zvol(x+1,y+1,z+1) );
-
-}
-
-template <class T>
-void get_stats(const volume<int>& labelim, const volume<T>& origim,vector<cluster<T> >& clusters,bool minv)
-{
-  int labelnum = labelim.max();
-  clusters.resize(labelnum);
-  for (int z=labelim.minz(); z<=labelim.maxz(); z++) {
-    for (int y=labelim.miny(); y<=labelim.maxy(); y++) {
-      for (int x=labelim.minx(); x<=labelim.maxx(); x++) {
-	int idx = labelim(x,y,z);
-	if ( idx-- ) {
-	  clusters[idx].originalLabel=idx+1; //slightly wasteful, but doesn't really matter
-	  T oxyz = origim(x,y,z);
-	  clusters[idx].size++;
-	  clusters[idx].cog.x+=((float) oxyz)*x;
-	  clusters[idx].cog.y+=((float) oxyz)*y;
-	  clusters[idx].cog.z+=((float) oxyz)*z;
-	  clusters[idx].meanval+=(float) oxyz;
-	  if ((clusters[idx].size==1) || ((oxyz>clusters[idx].maxval) && !minv ) || ((oxyz<clusters[idx].maxval) && minv )) {
-	    clusters[idx].maxval = oxyz;
-	    clusters[idx].maxpos.x = x;
-	    clusters[idx].maxpos.y = y;
-	    clusters[idx].maxpos.z = z;
+template <class T>
+void fill_cluster(cluster<T>& clust, const labelStats<T>& stats, const int label, const volume<T>& vol)
+{
+  clust.originalLabel=label;
+  clust.size=stats.size;
+  clust.bbmin=stats.bbmin;
+  clust.bbmax=stats.bbmax;
+  clust.maxval=stats.maxval;
+  clust.maxpos.x=stats.maxidx % vol.xsize();
+  clust.maxpos.y=(stats.maxidx / vol.xsize()) % vol.ysize();
+  clust.maxpos.z=stats.maxidx / (vol.xsize()*vol.ysize());
+  clust.cog.x=stats.cogx/stats.sum;
+  clust.cog.y=stats.cogy/stats.sum;
+  clust.cog.z=stats.cogz/stats.sum;
+  clust.meanval=stats.sum/stats.size;
+  clust.mass=stats.sum;
+}
+
+template <class I>
+inline I find_root(vector<I>& parent, I label)
+{
+  while (parent[label]!=label) {
+    parent[label]=parent[parent[label]];
+    label=parent[label];
+  }
+  return label;
+}
+
+// Voxels of threshvol inside [lower,upper] (outside, if invert), compared in
+// the data type of the input as when the mask was a volume<T>
+template <class T>
+void threshold_mask(const volume<T>& threshvol, const T lower, const T upper, const bool invert, bitmask& mask)
+{
+  binarise(threshvol,mask,lower,upper,inclusive,invert);
+}
+
+template <class T, class S>
+void threshold_mask(const volume<S>& threshvol, const T lower, const T upper, const bool invert, bitmask& mask)
+{
+  volume<T> converted;
+  copyconvert(threshvol,converted);
+  threshold_mask(converted,lower,upper,invert,mask);
+}
+
+// Thresholds threshvol into a bitmask, labels the connected suprathreshold voxels
+// and gathers the cluster statistics of zvol (and cope, if doCope) in a single
+// raster sweep that skips empty 64-voxel runs of the mask. With twotailed the
+// voxels at or below -th form the negative clusters in the same sweep, with
+// their extrema taken as minima, and voxels of opposite tails are never joined.
+// Provisional labels are joined with a union-find whose roots are always the
+// smallest label, so the final labels are numbered in order of first raster
+// occurrence, exactly as connected_components() numbers them. A non-empty
+// within mask restricts the clusters to its voxels.
+template <class T, class S>
+void label_clusters(const volume<T>& zvol, const volume<S>& threshvol, const T th, const bool minv,
+		    const bool twotailed, const bitmask& within, const volume<T>& cope, const bool doCope,
+		    const int connectivity, volume<int>& labelim, vector<cluster<T> >& clusters,
+		    vector<cluster<T> >& clustersCope)
+{
+  const int64_t nx(zvol.xsize()), ny(zvol.ysize()), nz(zvol.zsize());
+  bitmask mask, negmask;
+  threshold_mask(threshvol,th,std::numeric_limits<T>::max(),minv,mask);
+  if (twotailed) threshold_mask(threshvol,std::numeric_limits<T>::lowest(),(T) -th,false,negmask);
+  if (within.nvoxels()) {
+    mask&=within;
+    if (twotailed) negmask&=within;
+  }
+  copyconvert(zvol,labelim,false);
+  labelim=0;
+  vector<offset> neighbours(backConnectivity(connectivity));
+  vector<int64_t> shifts;
+  for (unsigned int k=0; k<neighbours.size(); k++)
+    shifts.push_back(neighbours[k].x + nx*(neighbours[k].y + ny*neighbours[k].z));
+
+  vector<int> parent(1,0);  //label 0 is background
+  vector<bool> negative(1,false);
+  vector<labelStats<T> > stats(1), copeStats(1);
+  int* lab(labelim.nsfbegin());
+  const T* zptr(zvol.fbegin());
+  const T* cptr(doCope ? cope.fbegin() : 0);
+  for (int z=0; z<nz; z++) {
+    for (int y=0; y<ny; y++) {
+      const uint64_t* row(mask.row(y,z));
+      const uint64_t* negrow(twotailed ? negmask.row(y,z) : 0);
+      for (int64_t w=0; w<mask.wordsperrow(); w++) {
+	const uint64_t negbits(twotailed ? negrow[w] : 0);
+	for (uint64_t bits=row[w]|negbits; bits!=0; bits&=bits-1) {
+	  const int b(__builtin_ctzll(bits)), x(w*64+b);
+	  const int64_t idx(x+nx*(y+ny*(int64_t) z));
+	  const bool neg((negbits>>b)&1), minvox(minv || neg);
+	  int label(0);
+	  for (unsigned int k=0; k<neighbours.size(); k++) {
+	    const int64_t xn(x+neighbours[k].x), yn(y+neighbours[k].y), zn(z+neighbours[k].z);
+	    if ( xn<0 || xn>=nx || yn<0 || yn>=ny || zn<0 ) continue;
+	    int other(lab[idx+shifts[k]]);
+	    if (other==0) continue;
+	    other=find_root(parent,other);
+	    if (negative[other]!=neg) continue;
+	    if (label==0) { label=other; continue; }
+	    if (other==label) continue;
+	    int keep(Min(label,other)), drop(Max(label,other));
+	    parent[drop]=keep;
+	    stats[keep].merge(stats[drop],minvox);
+	    if (doCope) copeStats[keep].merge(copeStats[drop],minvox);
+	    label=keep;
 	  }
+	  if (label==0) {
+	    label=parent.size();
+	    parent.push_back(label);
+	    negative.push_back(neg);
+	    stats.push_back(labelStats<T>());
+	    if (doCope) copeStats.push_back(labelStats<T>());
+	  }
+	  lab[idx]=label;
+	  stats[label].add(zptr[idx],idx,x,y,z,minvox);
+	  if (doCope) copeStats[label].add(cptr[idx],idx,x,y,z,minvox);
 	}
       }
     }
   }
+
+  // Number the roots in increasing order and resolve every provisional label
+  vector<int> finalLabel(parent.size(),0);
+  int nclusters(0);
+  for (unsigned int n=1; n<parent.size(); n++)
+    finalLabel[n] = (find_root(parent,(int) n)==(int) n) ? ++nclusters : finalLabel[parent[n]];
+  clusters.resize(nclusters);
+  if (doCope) clustersCope.resize(nclusters);
+  for (unsigned int n=1; n<parent.size(); n++) {
+    if (parent[n]!=(int) n) continue;
+    fill_cluster(clusters[finalLabel[n]-1],stats[n],finalLabel[n],zvol);
+    clusters[finalLabel[n]-1].negative=negative[n];
+    if (doCope) fill_cluster(clustersCope[finalLabel[n]-1],copeStats[n],finalLabel[n],zvol);
+  }
+  for (int64_t z=0; z<nz; z++)
+    for (int64_t y=0; y<ny; y++) {
+      const uint64_t* row(mask.row(y,z));
+      const uint64_t* negrow(twotailed ? negmask.row(y,z) : 0);
+      int* lrow(lab+nx*(y+ny*z));
+      for (int64_t w=0; w<mask.wordsperrow(); w++)
+	for (uint64_t bits=row[w]|(twotailed ? negrow[w] : 0); bits!=0; bits&=bits-1) {
+	  int& l(lrow[w*64+__builtin_ctzll(bits)]);
+	  l=finalLabel[l];
+	}
+    }
+}
+
+// Sweeps over the union of the cluster bounding boxes: every local maximum
+// is placed, in raster order, into the bucket of the cluster it belongs to
+// (buckets are indexed as clusters). Negative clusters of --twotailed take
+// the local minima instead.
+template <class T>
+void find_cluster_maxima(const vector<cluster<T> >& clusters, const volume<int>& labelim,
+			 const volume<T>& zvol, const int connectivity,
+			 vector<vector<pair<T, triple<float> > > >& buckets)
+{
+  buckets.clear();
+  buckets.resize(clusters.size());
+  if (clusters.empty()) return;
+  triple<int> lo(clusters[0].bbmin), hi(clusters[0].bbmax);
+  int maxLabel(0);
+  for (unsigned int n=0; n<clusters.size(); n++) {
+    lo.x=Min(lo.x,clusters[n].bbmin.x); hi.x=Max(hi.x,clusters[n].bbmax.x);
+    lo.y=Min(lo.y,clusters[n].bbmin.y); hi.y=Max(hi.y,clusters[n].bbmax.y);
+    lo.z=Min(lo.z,clusters[n].bbmin.z); hi.z=Max(hi.z,clusters[n].bbmax.z);
+    maxLabel=Max(maxLabel,clusters[n].originalLabel);
+  }
+  vector<int> bucketIndex(maxLabel+1,-1);
+  bool anyNegative(false);
   for (unsigned int n=0; n<clusters.size(); n++) {
-    if (clusters[n].size) {
-      clusters[n].cog.x /= clusters[n].meanval; //meanval is currently just sum
-      clusters[n].cog.y /= clusters[n].meanval;
-      clusters[n].cog.z /= clusters[n].meanval;
-      clusters[n].meanval /= clusters[n].size;
+    bucketIndex[clusters[n].originalLabel]=n;
+    anyNegative |= clusters[n].negative;
+  }
+  bitmask candidates(labelim.xsize(),labelim.ysize(),labelim.zsize()), negCandidates, peaks, negPeaks;
+  if (anyNegative) negCandidates.reinitialize(labelim.xsize(),labelim.ysize(),labelim.zsize());
+  for (int z=lo.z; z<=hi.z; z++)
+    for (int y=lo.y; y<=hi.y; y++)
+      for (int x=lo.x; x<=hi.x; x++) {
+	int label(labelim(x,y,z));
+	if ( label>0 && label<=maxLabel && bucketIndex[label]>=0 )
+	  (clusters[bucketIndex[label]].negative ? negCandidates : candidates).set(x,y,z);
+      }
+  local_extrema(zvol,candidates,peaks,connectivity,false);
+  if (anyNegative) local_extrema(zvol,negCandidates,negPeaks,connectivity,true);
+  for (int z=lo.z; z<=hi.z; z++)
+    for (int y=lo.y; y<=hi.y; y++)
+      for (int x=lo.x; x<=hi.x; x++)
+	if ( peaks(x,y,z) || (anyNegative && negPeaks(x,y,z)) )
+	  buckets[bucketIndex[labelim(x,y,z)]].push_back(make_pair(zvol(x,y,z),triple<float>(x,y,z)));
+}
+
+// Greedy non-maximum suppression of the (sorted) maxima of one cluster: a maximum
+// is kept unless it lies closer than mindist (in mm) to an already kept one, which
+// is what erasing every close successor of each survivor in turn gives. Kept
+// maxima are binned in a uniform grid with cells no smaller than mindist, so each
+// test only visits the surrounding 27 cells. Stops once maxcount are kept.
+template <class T>
+void suppress_close_maxima(const vector<pair<T, triple<float> > >& maxima, const Matrix& vox2mm,
+			   const float mindist, const unsigned int maxcount, vector<bool>& keep)
+{
+  keep.assign(maxima.size(),false);
+  if (maxima.empty()) return;
+  vector<triple<float> > mmcoords(maxima.size());
+  for (unsigned int n=0; n<maxima.size(); n++) {
+    const triple<float>& v(maxima[n].second);
+    mmcoords[n].x = vox2mm(1,1)*v.x + vox2mm(1,2)*v.y + vox2mm(1,3)*v.z + vox2mm(1,4);
+    mmcoords[n].y = vox2mm(2,1)*v.x + vox2mm(2,2)*v.y + vox2mm(2,3)*v.z + vox2mm(2,4);
+    mmcoords[n].z = vox2mm(3,1)*v.x + vox2mm(3,2)*v.y + vox2mm(3,3)*v.z + vox2mm(3,4);
+  }
+  triple<float> lo(mmcoords[0]), hi(mmcoords[0]);
+  for (unsigned int n=1; n<mmcoords.size(); n++) {
+    lo.x=Min(lo.x,mmcoords[n].x); hi.x=Max(hi.x,mmcoords[n].x);
+    lo.y=Min(lo.y,mmcoords[n].y); hi.y=Max(hi.y,mmcoords[n].y);
+    lo.z=Min(lo.z,mmcoords[n].z); hi.z=Max(hi.z,mmcoords[n].z);
+  }
+  // Cells are grown until the grid is not much larger than the number of maxima
+  double cell(mindist);
+  int64_t gx, gy, gz;
+  for (;;cell*=2) {
+    gx=(int64_t) ((hi.x-lo.x)/cell)+1; gy=(int64_t) ((hi.y-lo.y)/cell)+1; gz=(int64_t) ((hi.z-lo.z)/cell)+1;
+    if (gx*gy*gz <= 8*(int64_t) maxima.size()+64) break;
+  }
+  vector<int> cellHead(gx*gy*gz,-1), nextInCell(maxima.size(),-1);
+  unsigned int nkept(0);
+  for (unsigned int n=0; n<maxima.size() && nkept<maxcount; n++) {
+    const triple<float>& c(mmcoords[n]);
+    const int64_t cx((int64_t) ((c.x-lo.x)/cell)), cy((int64_t) ((c.y-lo.y)/cell)), cz((int64_t) ((c.z-lo.z)/cell));
+    bool close(false);
+    for (int64_t z=Max(cz-1,(int64_t) 0); z<=Min(cz+1,gz-1) && !close; z++)
+      for (int64_t y=Max(cy-1,(int64_t) 0); y<=Min(cy+1,gy-1) && !close; y++)
+	for (int64_t x=Max(cx-1,(int64_t) 0); x<=Min(cx+1,gx-1) && !close; x++)
+	  for (int k=cellHead[x+gx*(y+gy*z)]; k>=0 && !close; k=nextInCell[k]) {
+	    const triple<float>& o(mmcoords[k]);
+	    float dist(sqrt((o.x-c.x)*(o.x-c.x) + (o.y-c.y)*(o.y-c.y) + (o.z-c.z)*(o.z-c.z)));
+	    close = dist<mindist;
+	  }
+    if (close) continue;
+    keep[n]=true;
+    nkept++;
+    const int64_t cellIndex(cx+gx*(cy+gy*cz));
+    nextInCell[n]=cellHead[cellIndex];
+    cellHead[cellIndex]=n;
+  }
+}
+
+// Component (max-)tree of the suprathreshold sets of an image. Each node is a
+// connected component of {vol>=level} (of {vol<level} for minima) and holds
+// the statistics of all of its voxels, including those of its descendants.
+// It is built once from the voxels sorted by intensity with an incremental
+// union-find, after which the clusters at any threshold are read off the tree.
+// With strictly, voxels at the lowest threshold itself are left out as well.
+template <class T>
+class componentTree {
+public:
+  componentTree(const volume<T>& vol, const float lowestThreshold, const bool minv, const int connectivity,
+		const bool strictly=false);
+  void clusters(const float th, vector<cluster<T> >& clusters) const;
+  void tfce(const vector<float>& heights, const float H, const float E, const int nthreads, volume<float>& enhanced) const;
+private:
+  void tfce_node_shares(const int first, const int last, const vector<float>& heights,
+			const vector<double>& heightSums, const float E, vector<double>& enhancement) const;
+  void tfce_fill(const int64_t first, const int64_t last, const vector<double>& enhancement, float *out) const;
+  bool inside(const T level, const float th) const
+    { return minv ? (level<(T) th) : ((strict ? (level>(T) th) : (level>=(T) th)) && (level<=std::numeric_limits<T>::max())); }
+  const volume<T>& vol;
+  bool minv, strict;
+  vector<T> level;
+  vector<int> parent;             //parent node, -1 for roots
+  vector<int> canonical;          //nodes with equal levels are merged into one
+  vector<labelStats<T> > stats;
+  vector<int64_t> firstidx;       //earliest raster index, sets the cluster numbering
+  vector<int> roots;
+  vector<int> childStart, children;
+  vector<int> voxelNode;          //node of every voxel inside the loosest threshold, -1 elsewhere
+};
+
+template <class T>
+componentTree<T>::componentTree(const volume<T>& invol, const float lowestThreshold, const bool minvalues, const int connectivity,
+				const bool strictly) :
+  vol(invol), minv(minvalues), strict(strictly)
+{
+  const int64_t nx(vol.xsize()), ny(vol.ysize()), nz(vol.zsize());
+  vector<offset> neighbours(backConnectivity(connectivity));
+  for (unsigned int k=0, nback=neighbours.size(); k<nback; k++)
+    neighbours.push_back(offset(-neighbours[k].x,-neighbours[k].y,-neighbours[k].z));
+
+  // Only voxels inside the least restrictive threshold can be part of a cluster
+  const T* vptr(vol.fbegin());
+  vector<int64_t> order;
+  for (int64_t idx=0; idx<vol.nvoxels(); idx++)
+    if (inside(vptr[idx],lowestThreshold)) order.push_back(idx);
+  if (minv)
+    stable_sort(order.begin(),order.end(),[vptr](int64_t a, int64_t b) { return vptr[a]<vptr[b]; });
+  else
+    stable_sort(order.begin(),order.end(),[vptr](int64_t a, int64_t b) { return vptr[a]>vptr[b]; });
+
+  vector<int64_t> voxelParent(vol.nvoxels(),-1);
+  voxelNode.assign(vol.nvoxels(),-1);
+  vector<int> newChildren;
+  for (unsigned int n=0; n<order.size(); n++) {
+    const int64_t idx(order[n]);
+    const int x(idx % nx), y((idx / nx) % ny), z(idx / (nx*ny));
+    const T val(vptr[idx]);
+    voxelParent[idx]=idx;
+    int current(-1);
+    newChildren.clear();
+    for (unsigned int k=0; k<neighbours.size(); k++) {
+      const int64_t xn(x+neighbours[k].x), yn(y+neighbours[k].y), zn(z+neighbours[k].z);
+      if ( xn<0 || xn>=nx || yn<0 || yn>=ny || zn<0 || zn>=nz ) continue;
+      const int64_t nidx(idx + neighbours[k].x + nx*(neighbours[k].y + ny*neighbours[k].z));
+      if (voxelParent[nidx]<0) continue;  //not yet processed
+      const int64_t root(find_root(voxelParent,nidx));
+      if (root==idx) continue;            //already joined via another neighbour
+      const int node(find_root(canonical,voxelNode[root]));
+      voxelParent[root]=idx;
+      if (level[node]==val) {             //same level: the nodes are one component
+	if (current<0) { current=node; continue; }
+	canonical[node]=current;
+	stats[current].merge(stats[node],minv);
+	firstidx[current]=Min(firstidx[current],firstidx[node]);
+      } else {                            //completed component at a higher level
+	newChildren.push_back(node);
+      }
+    }
+    if (current<0) {
+      current=level.size();
+      level.push_back(val);
+      parent.push_back(-1);
+      canonical.push_back(current);
+      stats.push_back(labelStats<T>());
+      firstidx.push_back(idx);
+    }
+    stats[current].add(val,idx,x,y,z,minv);
+    firstidx[current]=Min(firstidx[current],idx);
+    for (unsigned int c=0; c<newChildren.size(); c++) {
+      parent[newChildren[c]]=current;
+      stats[current].merge(stats[newChildren[c]],minv);
+      firstidx[current]=Min(firstidx[current],firstidx[newChildren[c]]);
+    }
+    voxelNode[idx]=current;
+  }
+
+  // Resolve merged nodes and store the children of every node contiguously
+  for (unsigned int n=0; n<order.size(); n++)
+    voxelNode[order[n]]=find_root(canonical,voxelNode[order[n]]);
+  vector<int> nchildren(level.size()+1,0);
+  for (unsigned int node=0; node<level.size(); node++) {
+    if (canonical[node]!=(int) node) continue;
+    if (parent[node]<0) roots.push_back(node);
+    else {
+      parent[node]=find_root(canonical,parent[node]);
+      nchildren[parent[node]+1]++;
     }
   }
+  childStart.assign(level.size()+1,0);
+  for (unsigned int node=0; node<level.size(); node++)
+    childStart[node+1]=childStart[node]+nchildren[node+1];
+  children.resize(childStart.back());
+  vector<int> fill(childStart.begin(),childStart.end()-1);
+  for (unsigned int node=0; node<level.size(); node++)
+    if (canonical[node]==(int) node && parent[node]>=0)
+      children[fill[parent[node]]++]=node;
 }
 
-template <class T, class S>
-void relabel_image(const volume<int>& labelim, volume<T>& relabelim,
-		   const vector<S>& newlabels)
+// Clusters at threshold th are the largest nodes inside the threshold, found by
+// descending from the roots; they are returned in connected_components() order
+template <class T>
+void componentTree<T>::clusters(const float th, vector<cluster<T> >& clusters) const
 {
-  copyconvert(labelim,relabelim);
-  for (int z=relabelim.minz(); z<=relabelim.maxz(); z++)
-    for (int y=relabelim.miny(); y<=relabelim.maxy(); y++)
-      for (int x=relabelim.minx(); x<=relabelim.maxx(); x++)
-	relabelim(x,y,z) = (T) newlabels[labelim(x,y,z)];
+  vector<int> found, stack(roots.begin(),roots.end());
+  while (!stack.empty()) {
+    const int node(stack.back());
+    stack.pop_back();
+    if (inside(level[node],th)) { found.push_back(node); continue; }
+    for (int c=childStart[node]; c<childStart[node+1]; c++) stack.push_back(children[c]);
+  }
+  sort(found.begin(),found.end(),[this](int a, int b) { return firstidx[a]<firstidx[b]; });
+  clusters.resize(found.size());
+  for (unsigned int n=0; n<found.size(); n++)
+    fill_cluster(clusters[n],stats[found[n]],n+1,vol);
 }
 
+// Threshold-free cluster enhancement, with the same definition as tfce() in
+// newimage: a voxel gets the sum, over the heights h below its value, of
+// extent^E * h^H, where extent is the size of its cluster at h. A node is the
+// cluster of all its voxels for the heights between its parent's level and its
+// own, so its share is computed once and then added to all of its descendants.
 template <class T>
-void print_results(vector<cluster<T> >& clusters,
-		   vector<cluster<T> >& clustersCope,
-		   const volume<T>& zvol, const volume<T>& cope,
-		   const volume<int> &labelim, const volume<float> &empiricalP)
-{
-  bool doAffineTransform=false;
-  bool doWarpfieldTransform=false;
-  volume4D<float>  full_field;
-  volume<T> stdvol;
-  Matrix trans;
-  const volume<T> *refvol = &zvol;
+void componentTree<T>::tfce(const vector<float>& heights, const float H, const float E, const int nthreads, volume<float>& enhanced) const
+{
+  vector<double> heightSums(heights.size()+1,0);  //running sums of h^H
+  for (unsigned int k=0; k<heights.size(); k++) {
+    float HH=pow(heights[k],H);
+    heightSums[k+1]=heightSums[k]+HH;
+  }
+
+  vector<double> enhancement(level.size(),0);
+  int nthr(Max(1,Min(nthreads,(int) level.size())));
+  std::vector<std::thread> threads(nthr-1); // + main thread makes nthr
+  for (int t=0; t<nthr-1; t++)
+    threads[t] = std::thread(&componentTree<T>::tfce_node_shares,this,(t*(int64_t) level.size())/nthr,((t+1)*(int64_t) level.size())/nthr,
+			     std::cref(heights),std::cref(heightSums),E,std::ref(enhancement));
+  tfce_node_shares(((nthr-1)*(int64_t) level.size())/nthr,level.size(),heights,heightSums,E,enhancement);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+  // Parents are always created after their children
+  for (int node=level.size()-1; node>=0; node--)
+    if (canonical[node]==node && parent[node]>=0) enhancement[node]+=enhancement[parent[node]];
+
+  copyconvert(vol,enhanced,false);
+  const int64_t nvox(vol.nvoxels());
+  nthr=Max(1,(int) Min((int64_t) nthreads,nvox));
+  threads.resize(nthr-1);
+  for (int t=0; t<nthr-1; t++)
+    threads[t] = std::thread(&componentTree<T>::tfce_fill,this,(t*nvox)/nthr,((t+1)*nvox)/nthr,std::cref(enhancement),enhanced.nsfbegin());
+  tfce_fill(((nthr-1)*nvox)/nthr,nvox,enhancement,enhanced.nsfbegin());
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+}
+
+template <class T>
+void componentTree<T>::tfce_node_shares(const int first, const int last, const vector<float>& heights,
+					const vector<double>& heightSums, const float E, vector<double>& enhancement) const
+{
+  for (int node=first; node<last; node++) {
+    if (canonical[node]!=node) continue;
+    const int k1(lower_bound(heights.begin(),heights.end(),(float) level[node])-heights.begin());
+    const int k0(parent[node]<0 ? 0 : lower_bound(heights.begin(),heights.end(),(float) level[parent[node]])-heights.begin());
+    if (k1>k0) enhancement[node]=pow((double) stats[node].size,(double) E)*(heightSums[k1]-heightSums[k0]);
+  }
+}
+
+template <class T>
+void componentTree<T>::tfce_fill(const int64_t first, const int64_t last, const vector<double>& enhancement, float *out) const
+{
+  for (int64_t idx=first; idx<last; idx++)
+    out[idx] = (voxelNode[idx]<0) ? 0 : enhancement[voxelNode[idx]];
+}
+
+// Standard space used for reporting coordinates (--xfm, --stdvol, --warpvol)
+template <class T>
+struct referenceSpace {
+referenceSpace() : doAffineTransform(false), doWarpfieldTransform(false) {}
+bool doAffineTransform;
+bool doWarpfieldTransform;
+volume4D<float> full_field;
+volume<T> stdvol;
+Matrix trans;
+};
+
+template <class T>
+void read_reference_space(referenceSpace<T>& space)
+{
   if ( transformname.set() && stdvolname.set() ) {
-    read_volume(stdvol,stdvolname.value());
-    trans = read_ascii_matrix(transformname.value());
+    read_volume(space.stdvol,stdvolname.value());
+    space.trans = read_ascii_matrix(transformname.value());
     if (verbose.value()) {
       cout << "Transformation Matrix filename = "<<transformname.value()<<endl;
-      cout << trans.Nrows() << " " << trans.Ncols() << endl;
+      cout << space.trans.Nrows() << " " << space.trans.Ncols() << endl;
       cout << "Transformation Matrix = " << endl;
-      cout << trans << endl;
+      cout << space.trans << endl;
     }
-    doAffineTransform=true;
+    space.doAffineTransform=true;
   }
 
-  FnirtFileReader   reader;
   if (warpname.value().size())
   {
+    FnirtFileReader   reader;
     reader.Read(warpname.value());
-    full_field = reader.FieldAsNewimageVolume4D(true);
-    doWarpfieldTransform=true;
+    space.full_field = reader.FieldAsNewimageVolume4D(true);
+    space.doWarpfieldTransform=true;
+  }
+}
+
+// Input and output filenames of one statistic image: a single run takes them
+// from the command line, --batch reads one set per manifest line
+struct clusterJob {
+string inputname, copename, empiricalname;
+string outindex, outthresh, outlmax, outlmaxim, outsize, outmax, outmean, outpvals;
+string outtable;
+};
+
+vector<clusterJob> batchJobs;
+
+clusterJob command_line_job()
+{
+  clusterJob job;
+  job.inputname=inputname.value();
+  job.copename=copename.value();
+  job.empiricalname=empirical.value();
+  job.outindex=outindex.value();
+  job.outthresh=outthresh.value();
+  job.outlmax=outlmax.value();
+  job.outlmaxim=outlmaxim.value();
+  job.outsize=outsize.value();
+  job.outmax=outmax.value();
+  job.outmean=outmean.value();
+  job.outpvals=outpvals.value();
+  return job;
+}
+
+// Reads a --batch manifest: one image per line, each a whitespace separated
+// list of --key=value settings. Blank lines and lines starting with # are skipped.
+bool parse_manifest(const string& filename, vector<clusterJob>& jobs, string& error)
+{
+  jobs.clear();
+  ifstream manifest(filename.c_str());
+  if (!manifest) { error="Could not open manifest "+filename; return false; }
+  const pair<string, string clusterJob::*> keys[] = {
+    make_pair("--in",&clusterJob::inputname),      make_pair("--zstat",&clusterJob::inputname),
+    make_pair("--cope",&clusterJob::copename),     make_pair("--empiricalNull",&clusterJob::empiricalname),
+    make_pair("--oindex",&clusterJob::outindex),   make_pair("--othresh",&clusterJob::outthresh),
+    make_pair("--olmax",&clusterJob::outlmax),     make_pair("--olmaxim",&clusterJob::outlmaxim),
+    make_pair("--osize",&clusterJob::outsize),     make_pair("--omax",&clusterJob::outmax),
+    make_pair("--omean",&clusterJob::outmean),     make_pair("--opvals",&clusterJob::outpvals),
+    make_pair("--otable",&clusterJob::outtable) };
+  string line;
+  for (int lineno=1; getline(manifest,line); lineno++) {
+    stringstream fields(line);
+    string field;
+    if (!(fields >> field) || field[0]=='#') continue;
+    clusterJob job;
+    do {
+      size_t eq(field.find('='));
+      unsigned int k(0);
+      while (k<sizeof(keys)/sizeof(keys[0]) && (eq==string::npos || field.substr(0,eq)!=keys[k].first)) k++;
+      if (k==sizeof(keys)/sizeof(keys[0]) || eq+1==field.size()) {
+	error=filename+" line "+num2str(lineno)+": unrecognised entry "+field;
+	return false;
+      }
+      job.*(keys[k].second)=field.substr(eq+1);
+    } while (fields >> field);
+    if (job.inputname.empty()) { error=filename+" line "+num2str(lineno)+": no --in image"; return false; }
+    jobs.push_back(job);
+  }
+  if (jobs.empty()) { error="No images listed in manifest "+filename; return false; }
+  return true;
+}
+
+// Block of the input read for --roi/--roimask, as the (inclusive) voxel range
+// it covers in the whole image, with the header-only geometry of that image
+// and, for --roimask, the mask voxels within the block. Coordinates and maps
+// of the block are moved back into the whole image for output.
+template <class T>
+struct imageRegion {
+imageRegion() : restricted(false), x0(0), y0(0), z0(0), x1(-1), y1(-1), z1(-1) {}
+void to_image(triple<float>& coords) const { coords.x+=x0; coords.y+=y0; coords.z+=z0; }
+bool restricted;
+int64_t x0, y0, z0, x1, y1, z1;
+volume<T> geometry;
+bitmask mask;
+private:
+imageRegion(const imageRegion&);
+imageRegion& operator=(const imageRegion&);
+};
+
+// The block is the bounding box of the --roi corners (nifti voxel or, with
+// --mm, mm coordinates, as in the table) intersected with the bounding box of
+// the nonzero --roimask voxels
+template <class T>
+void find_region(const string& filename, imageRegion<T>& region)
+{
+  region.restricted = roibox.set() || roimask.set();
+  if (!region.restricted) return;
+  read_volume_hdr_only(region.geometry,filename);
+  int64_t lo[3] = {0, 0, 0};
+  int64_t hi[3] = {region.geometry.xsize()-1, region.geometry.ysize()-1, region.geometry.zsize()-1};
+  if (roibox.set()) {
+    const vector<float>& box(roibox.value());
+    const Matrix toVoxel( mm.value() ? region.geometry.newimagevox2mm_mat().i() : region.geometry.niftivox2newimagevox_mat() );
+    float boxlo[3], boxhi[3];
+    for (int c=0; c<8; c++) {
+      triple<float> corner(box[c&1],box[2+((c>>1)&1)],box[4+((c>>2)&1)]);
+      MultiplyCoordinateVector(corner,toVoxel);
+      const float v[3] = {corner.x, corner.y, corner.z};
+      for (int d=0; d<3; d++) {
+	boxlo[d] = (c==0) ? v[d] : Min(boxlo[d],v[d]);
+	boxhi[d] = (c==0) ? v[d] : Max(boxhi[d],v[d]);
+      }
+    }
+    for (int d=0; d<3; d++) {
+      lo[d]=Max(lo[d],(int64_t) ceil(boxlo[d]-1e-3));
+      hi[d]=Min(hi[d],(int64_t) floor(boxhi[d]+1e-3));
+    }
+  }
+  // the mask is read whole, as a float image so fractional values count as nonzero
+  volume<float> maskvol;
+  if (roimask.set()) {
+    read_volume(maskvol,roimask.value());
+    if (!samesize(maskvol,region.geometry))
+      imthrow("Mask "+roimask.value()+" does not have the dimensions of "+filename,3);
+    int64_t masklo[3] = {hi[0]+1, hi[1]+1, hi[2]+1}, maskhi[3] = {-1, -1, -1};
+    for (int64_t z=lo[2]; z<=hi[2]; z++)
+      for (int64_t y=lo[1]; y<=hi[1]; y++)
+	for (int64_t x=lo[0]; x<=hi[0]; x++)
+	  if (maskvol(x,y,z)!=0) {
+	    const int64_t v[3] = {x, y, z};
+	    for (int d=0; d<3; d++) { masklo[d]=Min(masklo[d],v[d]); maskhi[d]=Max(maskhi[d],v[d]); }
+	  }
+    for (int d=0; d<3; d++) { lo[d]=masklo[d]; hi[d]=maskhi[d]; }
+  }
+  if ( lo[0]>hi[0] || lo[1]>hi[1] || lo[2]>hi[2] )
+    imthrow("The --roi/--roimask region contains no voxels of "+filename,3);
+  region.x0=lo[0]; region.y0=lo[1]; region.z0=lo[2];
+  region.x1=hi[0]; region.y1=hi[1]; region.z1=hi[2];
+  if (roimask.set()) {
+    region.mask.reinitialize(region.x1-region.x0+1,region.y1-region.y0+1,region.z1-region.z0+1);
+    for (int64_t z=0; z<region.mask.zsize(); z++)
+      for (int64_t y=0; y<region.mask.ysize(); y++)
+	for (int64_t x=0; x<region.mask.xsize(); x++)
+	  if (maskvol(region.x0+x,region.y0+y,region.z0+z)!=0) region.mask.set(x,y,z);
+  }
+  if (verbose.value())
+    cout << "Reading voxels " << region.x0 << "-" << region.x1 << ", " << region.y0 << "-" << region.y1
+	 << ", " << region.z0 << "-" << region.z1 << " of " << filename << endl;
+}
+
+// Reads the image, or just the block of it given by the region. The block is
+// read as stored and its header offset to the block's first voxel before it is
+// swapped to radiological order, so it is a valid image of that sub-volume.
+template <class T, class S>
+void read_block(volume<S>& vol, const string& filename, const imageRegion<T>& region)
+{
+  if (!region.restricted) {
+    read_volume(vol,filename);
+    return;
+  }
+  volume<S> header;
+  read_volume_hdr_only(header,filename);
+  if (!samesize(header,region.geometry))
+    imthrow(filename+" does not have the dimensions of the input image",3);
+  int64_t fx0(region.x0), fx1(region.x1);
+  if (!header.RadiologicalFile) {
+    fx0=header.xsize()-1-region.x1;
+    fx1=header.xsize()-1-region.x0;
+  }
+  short dtype;
+  read_volumeROI(vol,filename,dtype,fx0,region.y0,region.z0,0,fx1,region.y1,region.z1,0,false);
+  Matrix offset(IdentityMatrix(4));
+  offset(1,4)=fx0;
+  offset(2,4)=region.y0;
+  offset(3,4)=region.z0;
+  vol.set_sform(vol.sform_code(),vol.sform_mat()*offset);
+  vol.set_qform(vol.qform_code(),vol.qform_mat()*offset);
+  if (!vol.RadiologicalFile) vol.makeradiological();
+}
+
+// Output map of the whole input image: with --roi/--roimask it starts as
+// zeros, and the block is filled in at its position
+template <class T, class S>
+void allocate_map(const volume<int>& labelim, const imageRegion<T>& region, volume<S>& map)
+{
+  if (region.restricted) {
+    copyconvert(region.geometry,map,false);
+    map=0;
+  }
+  else copyconvert(labelim,map,false);
+}
+
+// The requested output maps of one image (or, for a 4D input, of all its
+// volumes); maps that are not requested stay empty
+template <class T>
+struct outputMaps {
+volume<int> index, size;
+volume<T> max, thresh;
+volume<float> mean, logp;
+volume<char> lmax;
+};
+
+// Reported index of every cluster: 1 to N in ascending order of size, except
+// for the negative clusters of --twotailed (stored first) which are -1 to -M
+template <class T>
+vector<int> cluster_indices(const vector<cluster<T> >& clusters)
+{
+  int nnegative(0);
+  for (unsigned int n=0; n<clusters.size(); n++)
+    if (clusters[n].negative) nnegative++;
+  vector<int> indices(clusters.size());
+  for (unsigned int n=0; n<clusters.size(); n++)
+    indices[n] = clusters[n].negative ? -(int)(n+1) : n+1-nnegative;
+  return indices;
+}
+
+template <class T>
+void print_results(vector<cluster<T> >& clusters,
+		   vector<cluster<T> >& clustersCope,
+		   const volume<T>& zvol, const volume<int> &labelim, const imageRegion<T>& region,
+		   const referenceSpace<T>& space, const clusterJob& job, ostream& out,
+		   ostream& lmaxfile, volume<char>& lmaxvol)
+{
+  const bool doCope(!job.copename.empty());
+  const bool doAffineTransform(space.doAffineTransform);
+  const bool doWarpfieldTransform(space.doWarpfieldTransform);
+  const volume4D<float>& full_field(space.full_field);
+  const volume<T>& stdvol(space.stdvol);
+  const Matrix& trans(space.trans);
+  // coordinates are reported in the whole image, also for a --roi/--roimask block
+  const volume<T>& image(region.restricted ? region.geometry : zvol);
+  const volume<T> *refvol = &image;
+  for (unsigned int n=0; n<clusters.size(); n++) {
+    region.to_image(clusters[n].maxpos);
+    region.to_image(clusters[n].cog);
+    if (doCope) region.to_image(clustersCope[n].maxpos);
   }
 
   if ( doAffineTransform || doWarpfieldTransform ) {
+    vector<triple<float>*> coords;
     for (unsigned int n=0; n<clusters.size(); n++) {
-      TransformToReference(clusters[n].maxpos,trans,zvol,stdvol,full_field,doAffineTransform,doWarpfieldTransform);
-      TransformToReference(clusters[n].cog,trans,zvol,stdvol,full_field,doAffineTransform,doWarpfieldTransform);
-      if (copename.set()) TransformToReference(clustersCope[n].maxpos,trans,zvol,stdvol,full_field,doAffineTransform,doWarpfieldTransform);
+      coords.push_back(&clusters[n].maxpos);
+      coords.push_back(&clusters[n].cog);
+      if (doCope) coords.push_back(&clustersCope[n].maxpos);
     }
+    TransformToReference(coords,trans,image,stdvol,full_field,doAffineTransform,doWarpfieldTransform);
   }
 
   if ( doAffineTransform ) refvol = &stdvol;
@@ -358,47 +1056,45 @@ void print_results(vector<cluster<T> >& clusters,
   for (unsigned int n=0; n<clusters.size(); n++) {
     MultiplyCoordinateVector(clusters[n].maxpos,toDisplayCoord);
     MultiplyCoordinateVector(clusters[n].cog,toDisplayCoord);
-    if (copename.set()) MultiplyCoordinateVector(clustersCope[n].maxpos,toDisplayCoord);   // used cope before
+    if (doCope) MultiplyCoordinateVector(clustersCope[n].maxpos,toDisplayCoord);   // used cope before
   }
 
 
   string units(mm.value() ? " (mm)" : " (vox)");
   string tablehead;
   tablehead = "Cluster Index\tVoxels";
-  if (pthresh.set()) tablehead += "\tP\t-log10(P)";
+  if (pthresh.set() || nullstack.set()) tablehead += "\tP\t-log10(P)";
+  if (nullstack.set()) tablehead += "\tMASS\tMASS P";
   string z=scalarname.value()+"-";
   if (z=="-") { z=""; }
   tablehead += "\t"+z+"MAX\t"+z+"MAX X" + units + "\t"+z+"MAX Y" + units + "\t"+z+"MAX Z" + units
     + "\t"+z+"COG X" + units + "\t"+z+"COG Y" + units + "\t"+z+"COG Z" + units;
-  if (copename.set()) {
+  if (doCope) {
     tablehead+= "\tCOPE-MAX\tCOPE-MAX X" + units + "\tCOPE-MAX Y" + units + "\tCOPE-MAX Z" + units
                  + "\tCOPE-MEAN";
   }
 
-  if (!no_table.value()) cout << tablehead << endl;
+  if (!no_table.value()) out << tablehead << endl;
+  const vector<int> indices(cluster_indices(clusters));
   for (int n=clusters.size()-1; n>=0 && !no_table.value(); n--) {
-      cout << setprecision(3) << num(n+1) << "\t" << clusters[n].size << "\t";
-      if (pthresh.set()) { cout << num(clusters[n].pval) << "\t" << num(-clusters[n].logpval) << "\t"; }
-        cout << num(clusters[n].maxval) << "\t"
+      out << setprecision(3) << num(indices[n]) << "\t" << clusters[n].size << "\t";
+      if (pthresh.set() || nullstack.set()) { out << num(clusters[n].pval) << "\t" << num(-clusters[n].logpval) << "\t"; }
+      if (nullstack.set()) { out << num(clusters[n].mass) << "\t" << num(clusters[n].masspval) << "\t"; }
+        out << num(clusters[n].maxval) << "\t"
 	   << num(clusters[n].maxpos.x) << "\t" << num(clusters[n].maxpos.y) << "\t"
 	   << num(clusters[n].maxpos.z) << "\t"
 	   << num(clusters[n].cog.x) << "\t" << num(clusters[n].cog.y) << "\t"
 	   << num(clusters[n].cog.z);
-      if (!copename.unset()) {
-	  cout   << "\t" << num(clustersCope[n].maxval) << "\t"
+      if (doCope) {
+	  out    << "\t" << num(clustersCope[n].maxval) << "\t"
 	       << num(clustersCope[n].maxpos.x) << "\t" << num(clustersCope[n].maxpos.y) << "\t"
 	       << num(clustersCope[n].maxpos.z) << "\t" << num(clustersCope[n].meanval);
 	}
-        cout << endl;
+        out << endl;
 
   }
   // output local maxima (peak table)
-  if (outlmax.set() || outlmaxim.set()) {
-    string outlmaxfile="/dev/null";
-    if (outlmax.set()) { outlmaxfile=outlmax.value(); }
-    ofstream lmaxfile(outlmaxfile.c_str());
-    if (!lmaxfile)
-      cerr << "Could not open file " << outlmax.value() << " for writing" << endl;
+  if (job.outlmax.size() || job.outlmaxim.size()) {
     string scalarnm=scalarname.value();
     if (scalarnm=="") { scalarnm="Value"; }
     string p_header="";
@@ -407,38 +1103,41 @@ void print_results(vector<cluster<T> >& clusters,
     }
 
     lmaxfile << "Cluster Index\t"+scalarnm+p_header+"\tx\ty\tz\t" << endl;
-    volume<char> lmaxvol;
-    copyconvert(zvol,lmaxvol);
-    lmaxvol=0;
+    if (job.outlmaxim.size()) {
+      allocate_map(labelim,region,lmaxvol);
+      lmaxvol=0;
+    }
     zvol.setextrapolationmethod(zeropad);
+    vector<vector<pair<T, triple<float> > > > candidates;
+    find_cluster_maxima(clusters,labelim,zvol,numconnected.value(),candidates);
+    vector<pair<int, pair<T, triple<float> > > > peaks;  //cluster number and maximum, in output order
     for (int n=clusters.size()-1; n>=0; n--) {
-      vector<pair<T, triple<float> > > maxima;
-      for (int z=labelim.minz(); z<=labelim.maxz(); z++)
-	for (int y=labelim.miny(); y<=labelim.maxy(); y++)
-	  for (int x=labelim.minx(); x<=labelim.maxx(); x++)
-	    if ( checkIfLocalMaxima(clusters[n].originalLabel,labelim,zvol,numconnected.value(),x,y,z))
-	      maxima.push_back(make_pair(zvol(x,y,z),triple<float>(x,y,z)));
-      sort(maxima.rbegin(),maxima.rend());
-      if (peakdist.value()>0) {
-	for(unsigned int source=0;source<maxima.size();source++)
-	  {
-	    triple<float> sourcecoord(maxima[source].second);
-	    MultiplyCoordinateVector(sourcecoord,refvol->newimagevox2mm_mat());
-	    for(typename vector<pair<T, triple<float> > >::iterator clust=maxima.begin()+source+1; clust !=maxima.end();)
-	    {
-	      triple<float> clustcoord((*clust).second);
-	      MultiplyCoordinateVector(clustcoord,refvol->newimagevox2mm_mat());
-	      float dist(sqrt((sourcecoord.x-clustcoord.x)*(sourcecoord.x-clustcoord.x) + (sourcecoord.y-clustcoord.y )*(sourcecoord.y-clustcoord.y) + (sourcecoord.z-clustcoord.z)*(sourcecoord.z-clustcoord.z)));
-	      clust = dist<peakdist.value() ? maxima.erase(clust) : clust+1;
-	    }
-	  }
+      vector<pair<T, triple<float> > >& maxima(candidates[n]);
+      if (clusters[n].negative) sort(maxima.begin(),maxima.end());
+      else sort(maxima.rbegin(),maxima.rend());
+      const unsigned int maxcount(std::min(maxima.size(),(size_t)mx_cnt.value()));
+      vector<bool> keep(maxima.size(),true);
+      if (peakdist.value()>0) suppress_close_maxima(maxima,refvol->newimagevox2mm_mat(),peakdist.value(),maxcount,keep);
+      unsigned int reported(0);
+      for(typename vector<pair<T, triple<float> > >::iterator point=maxima.begin(); point !=maxima.end() && reported<maxcount; ++point) {
+	if (!keep[point-maxima.begin()]) continue;
+	reported++;
+	pair<T, triple<float> > peak(*point);
+	region.to_image(peak.second);
+	if (job.outlmaxim.size())
+	  lmaxvol(MISCMATHS::round(peak.second.x),
+		  MISCMATHS::round(peak.second.y),
+		  MISCMATHS::round(peak.second.z))=1;
+	peaks.push_back(make_pair(indices[n],peak));
       }
-      maxima.resize(std::min(maxima.size(),(size_t)mx_cnt.value()));
-      for(typename vector<pair<T, triple<float> > >::iterator point=maxima.begin(); point !=maxima.end(); ++point) { //output results
-	lmaxvol(MISCMATHS::round((*point).second.x),
-		MISCMATHS::round((*point).second.y),
-		MISCMATHS::round((*point).second.z))=1;
-	if ( doAffineTransform || doWarpfieldTransform ) TransformToReference((*point).second,trans,zvol,stdvol,full_field,doAffineTransform,doWarpfieldTransform);
+    }
+    if ( doAffineTransform || doWarpfieldTransform ) {
+      vector<triple<float>*> coords;
+      for (unsigned int p=0; p<peaks.size(); p++) coords.push_back(&peaks[p].second.second);
+      TransformToReference(coords,trans,image,stdvol,full_field,doAffineTransform,doWarpfieldTransform);
+    }
+    for(typename vector<pair<int, pair<T, triple<float> > > >::iterator peak=peaks.begin(); peak !=peaks.end(); ++peak) { //output results
+	pair<T, triple<float> >* point(&peak->second);
 	MultiplyCoordinateVector((*point).second, toDisplayCoord);
 
         int twotailed = 0;
@@ -456,95 +1155,140 @@ void print_results(vector<cluster<T> >& clusters,
 
                p_vox = ztop_function(twotailed, grf, (*point).first, nresels);
 
-               lmaxfile << setprecision(3) << n+1 << "\t" << (*point).first << "\t" <<
+               lmaxfile << setprecision(3) << peak->first << "\t" << (*point).first << "\t" <<
                         p_vox << "\t" << -log10(p_vox) << "\t" <<
                        (*point).second.x << "\t" << (*point).second.y << "\t" << (*point).second.z << endl;
         } else {
                 // Cluster-wise threshold
-               lmaxfile << setprecision(3) << n+1 << "\t" << (*point).first << "\t" <<
+               lmaxfile << setprecision(3) << peak->first << "\t" << (*point).first << "\t" <<
                        (*point).second.x << "\t" << (*point).second.y << "\t" << (*point).second.z << endl;
         }
-      }
-    }
-    lmaxfile.close();
-    if (outlmaxim.set()) {
-      lmaxvol.setDisplayMaximumMinimum(0.0f,0.0f);
-      save_volume(lmaxvol,outlmaxim.value());
     }
   }
 }
 
 
 
+// Null distributions of the largest cluster size and mass in each volume of a
+// --nullstack image, kept sorted. Masses of --min clusters are negated.
+struct clusterNull {
+vector<unsigned int> maxsize;
+vector<float> maxmass;
+bool empty() const { return maxsize.empty(); }
+float size_p(const unsigned int size) const { return exceedance(maxsize,size); }
+float mass_p(const float mass) const { return exceedance(maxmass,mass); }
+// The observed image counts as one member of the null, so p is never 0
+template <class V>
+static float exceedance(const vector<V>& null, const V value)
+{ return (1.0f + (null.end()-lower_bound(null.begin(),null.end(),value)))/(1.0f + null.size()); }
+};
+
+// Labels the null volumes as they are read from the stack, which is shared
+// by all the threads: only one volume per thread is held in memory
 template <class T>
-int fmrib_main(int argc, char *argv[])
+void null_worker(volumeStream& stack, std::mutex& reading, const volume<T>& zvol, const T th,
+		 clusterNull& null, std::exception_ptr& error)
 {
+  volume<T> vol;
   volume<int> labelim;
-  float th = thresh.value();
-
-  // read in the volume
-  volume<T> zvol, mask, cope;
-  volume<float> empiricalP;
-  read_volume(zvol,inputname.value());
-  if (verbose.value())  print_volume_info(zvol,"Zvol");
-
-  if ( fractional.value() ) {
-    float frac = th;
-    th = frac*(zvol.robustmax() - zvol.robustmin()) + zvol.robustmin();
-  }
-
-  // Threshold the input volume using thresh value (--thresh option)
-  // For cluster-wise threshold this correspond to the cluster-forming
-  // threshold. For voxel-wise threshold this is the only thresholding we need.
-  mask=zvol;
-  if ( empirical.set() ) {
-    read_volume(empiricalP,empirical.value());
-    copyconvert(empiricalP,mask);
+  vector<cluster<T> > clusters, unused;
+  try {
+    while (true) {
+      int64_t n;
+      {
+	std::lock_guard<std::mutex> lock(reading);
+	n=stack.volumesRead();
+	if (!stack.read_next_volume(vol)) return;
+      }
+      if (!samesize(vol,zvol))
+	imthrow("Volume "+num2str(n)+" of "+nullstack.value()+" does not match the size of the input",3);
+      label_clusters(vol,vol,th,minv.value(),false,bitmask(),vol,false,numconnected.value(),labelim,clusters,unused);
+      unsigned int maxsize(0);
+      float maxmass(0);
+      for (unsigned int c=0; c<clusters.size(); c++) {
+	maxsize=Max(maxsize,clusters[c].size);
+	maxmass=Max(maxmass,minv.value() ? -clusters[c].mass : clusters[c].mass);
+      }
+      null.maxsize[n]=maxsize;
+      null.maxmass[n]=maxmass;
+    }
+  } catch (...) {
+    error=std::current_exception();
   }
-  mask.binarise((T) th);
-  if (minv.value()) { mask = ((T) 1) - mask; }
-  if (verbose.value())  print_volume_info(mask,"Mask");
-
-  // Find the connected components
-  labelim = connected_components(mask,numconnected.value());
-  if (verbose.value())  print_volume_info(labelim,"Labelim");
-
-  // process according to the output format
-  vector<cluster<T> > clusters;
-  get_stats(labelim,zvol,clusters,minv.value());
-  int nOriginalLabels(clusters.size()+1); //0 is also a label of sorts
-  if (verbose.value()) cout<<"Number of labels = "<<clusters.size()<<endl;
+}
 
-  // process the cope image if entered
-  vector<cluster<T> > clustersCope;
-  if (!copename.unset()) {
-    read_volume(cope,copename.value());
-    get_stats(labelim,cope,clustersCope,minv.value());
-  }
+template <class T>
+void build_cluster_null(const string& filename, const volume<T>& zvol, const T th, clusterNull& null)
+{
+  volumeStream stack(filename);
+  if (stack.nvolumes()<1) imthrow("No volumes in "+filename,3);
+  null.maxsize.assign(stack.nvolumes(),0);
+  null.maxmass.assign(stack.nvolumes(),0);
+  std::mutex reading;
+  const int nthr(Max(1,(int) Min((int64_t) nthreads.value(),stack.nvolumes())));
+  vector<std::exception_ptr> errors(nthr);
+  std::vector<std::thread> threads(nthr-1); // + main thread makes nthr
+  for (int t=0; t<nthr-1; t++)
+    threads[t] = std::thread(null_worker<T>,std::ref(stack),std::ref(reading),std::cref(zvol),th,std::ref(null),std::ref(errors[t]));
+  null_worker(stack,reading,zvol,th,null,errors[nthr-1]);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+  for (unsigned int t=0; t<errors.size(); t++)
+    if (errors[t]) std::rethrow_exception(errors[t]);
+  sort(null.maxsize.begin(),null.maxsize.end());
+  sort(null.maxmass.begin(),null.maxmass.end());
+  if (verbose.value())
+    cout << "Null of " << stack.nvolumes() << " volumes: largest cluster size " << null.maxsize.back()
+	 << ", largest cluster mass " << null.maxmass.back() << endl;
+}
 
+// Assigns p-values to the clusters and keeps only the significant ones
+// (cluster-wise thresholding only), sorted in ascending size order
+template <class T>
+void select_clusters(vector<cluster<T> >& clusters, vector<cluster<T> >& clustersCope,
+		     const float th, const volume<T>& zvol, const volume<float>& empiricalP,
+		     const bool doEmpirical, const clusterNull& null, const bool reportMinSize, ostream& out)
+{
   sort(clusters.rbegin(),clusters.rend());        //Sort descending for threshold purposes
   sort(clustersCope.rbegin(),clustersCope.rend());
 
   // Get p-value and log(pval) for all clusters/peaks
   int nozeroclust=0;
-  if (pthresh.set() || voxthresh.set() || voxuncthresh.set() || empirical.set()) {
+  if ( !null.empty() ) {
+    // FWE-corrected p-values from the permutation null, in place of GRF theory
+    if (pthresh.set() && minclustersize.value() && reportMinSize) {
+      unsigned int nmin(1);
+      while (nmin<=null.maxsize.back() && null.size_p(nmin)>=pthresh.value()) nmin++;
+      if (null.size_p(nmin)<pthresh.value())
+	out << "Minimum cluster size under p-threshold = " << nmin << endl;
+      else
+	out << "No cluster size is under the p-threshold with " << null.maxsize.size() << " null volumes" << endl;
+    }
+    for (unsigned int n=0; n<clusters.size(); n++) {
+      clusters[n].pval = null.size_p(clusters[n].size);
+      clusters[n].logpval = -log10(1.0f/clusters[n].pval);  //so that p=1 prints as 0, not -0
+      clusters[n].masspval = null.mass_p(minv.value() ? -clusters[n].mass : clusters[n].mass);
+      if (pthresh.set() && clusters[n].pval>pthresh.value())
+	nozeroclust++;
+    }
+  }
+  else if (pthresh.set() || voxthresh.set() || voxuncthresh.set() || doEmpirical) {
 
     if (verbose.value())
       cout<<"Re-thresholding with p-value"<<endl;
     Infer infer(dLh.value(), th, voxvol.value());
     if (pthresh.set()) {
       // Get minimum cluster size corresponding to cluster-wise p threshold
-      if (labelim.zsize()<=1)
+      if (zvol.zsize()<=1)
 	infer.setD(2); // the 2D option
-      if (minclustersize.value()) {
+      if (minclustersize.value() && reportMinSize) {
 	float pmin=1.0;
 	unsigned int nmin=0;
 	while (pmin>=pthresh.value()) pmin=exp(infer(++nmin));
-	cout << "Minimum cluster size under p-threshold = " << nmin << endl;
+	out << "Minimum cluster size under p-threshold = " << nmin << endl;
       }
       // Calculate p-value and log(pval) for each cluster
       for (unsigned int n=0; n<clusters.size(); n++) {
-	if ( empirical.set() )
+	if ( doEmpirical )
 	  clusters[n].logpval = log(1.0-empiricalP(clusters[n].maxpos.x,clusters[n].maxpos.y,clusters[n].maxpos.z))/log(10);
 	else
 	  clusters[n].logpval = infer((float)clusters[n].size)/log(10);
@@ -567,69 +1311,476 @@ int fmrib_main(int argc, char *argv[])
   clustersCope.resize(n);
   reverse(clusters.begin(),clusters.end());        //Ascending for output
   reverse(clustersCope.begin(),clustersCope.end());
+}
+
+// Parses a comma-separated list of thresholds, each entry either a single
+// value or an inclusive start:step:stop range
+bool parse_threshold_list(const string& list, vector<float>& thresholds)
+{
+  thresholds.clear();
+  stringstream entries(list);
+  string entry;
+  while (getline(entries,entry,',')) {
+    vector<float> range;
+    stringstream fields(entry);
+    string field;
+    while (getline(fields,field,':')) {
+      char *end;
+      range.push_back(strtof(field.c_str(),&end));
+      if (field.empty() || *end!='\0') return false;
+    }
+    if (range.size()==1) thresholds.push_back(range[0]);
+    else if (range.size()==3 && range[1]>0) {
+      for (int n=0; range[0]+n*range[1]<=range[2]+1e-6*range[1]; n++)
+	thresholds.push_back(range[0]+n*range[1]);
+    }
+    else return false;
+  }
+  return !thresholds.empty();
+}
 
+// Reports the clusters at every --threshlist threshold from a single
+// component tree, instead of re-thresholding and re-labelling each time
+template <class T>
+int threshold_sweep(const volume<T>& zvol, const referenceSpace<T>& space)
+{
+  vector<float> thresholds;
+  parse_threshold_list(threshlist.value(),thresholds);
+  if ( fractional.value() ) {
+    const float robustmin(zvol.robustmin()), robustrange(zvol.robustmax()-zvol.robustmin());
+    for (unsigned int t=0; t<thresholds.size(); t++)
+      thresholds[t] = thresholds[t]*robustrange + robustmin;
+  }
+  const float loosest = minv.value() ? *max_element(thresholds.begin(),thresholds.end()) :
+                                       *min_element(thresholds.begin(),thresholds.end());
+  componentTree<T> tree(zvol,loosest,minv.value(),numconnected.value());
+
+  clusterJob tablesOnly;
+  imageRegion<T> wholeImage;
+  volume<char> noPeaks;
+  volume<int> labelim;
+  volume<float> empiricalP;
+  for (unsigned int t=0; t<thresholds.size(); t++) {
+    vector<cluster<T> > clusters, clustersCope;
+    tree.clusters(thresholds[t],clusters);
+    if (verbose.value()) cout<<"Number of labels at threshold "<<thresholds[t]<<" = "<<clusters.size()<<endl;
+    select_clusters(clusters,clustersCope,thresholds[t],zvol,empiricalP,false,clusterNull(),true,cout);
+    if (!no_table.value()) cout << (t ? "\n" : "") << "Threshold\t" << setprecision(6) << thresholds[t] << endl;
+    print_results(clusters,clustersCope,zvol,labelim,wholeImage,space,tablesOnly,cout,cout,noPeaks);
+  }
+  return 0;
+}
+
+// Values of every output map for one label
+template <class T>
+struct labelOutputs {
+labelOutputs() : index(0), size(0), maxval(0), meanval(0), logpval(0) {}
+int index;
+int size;
+T maxval;
+float meanval;
+float logpval;
+};
+
+template <class T>
+void save_output_volume(const volume<T>& vol, const string& filename, std::exception_ptr& error)
+{
+  try {
+    save_volume(vol,filename);
+  } catch (...) {
+    error=std::current_exception();
+  }
+}
+
+// Fills all the requested cluster maps (--oindex, --osize, --omax, --omean,
+// --opvals and --othresh) in one sweep over the label image, using a table
+// indexed by the original labels
+template <class T>
+void fill_output_maps(const clusterJob& job, const vector<cluster<T> >& clusters, const int nOriginalLabels,
+		      const volume<int>& labelim, const volume<T>& zvol, const imageRegion<T>& region,
+		      outputMaps<T>& maps)
+{
+  vector<labelOutputs<T> > table(nOriginalLabels);
+  const vector<int> indices(cluster_indices(clusters));
+  for (unsigned int n=0; n<clusters.size(); n++) {
+    labelOutputs<T>& entry(table[clusters[n].originalLabel]);
+    entry.index=indices[n];
+    entry.size=clusters[n].size;
+    entry.maxval=clusters[n].maxval;
+    entry.meanval=clusters[n].meanval;
+    entry.logpval=clusters[n].logpval;
+  }
+
+  int *index(0), *size(0);
+  T *maxv(0), *thr(0);
+  float *mean(0), *logp(0);
+  if (job.outindex.size()) { allocate_map(labelim,region,maps.index); index=maps.index.nsfbegin(); }
+  if (job.outsize.size()) { allocate_map(labelim,region,maps.size); size=maps.size.nsfbegin(); }
+  if (job.outmax.size()) { allocate_map(labelim,region,maps.max); maxv=maps.max.nsfbegin(); }
+  if (job.outmean.size()) { allocate_map(labelim,region,maps.mean); mean=maps.mean.nsfbegin(); }
+  if (job.outpvals.size()) { allocate_map(labelim,region,maps.logp); logp=maps.logp.nsfbegin(); }
+  if (job.outthresh.size()) { allocate_map(labelim,region,maps.thresh); thr=maps.thresh.nsfbegin(); }
+
+  const int *lab(labelim.fbegin());
+  const T *zptr(zvol.fbegin());
+  const int64_t nx(labelim.xsize()), ny(labelim.ysize()), nz(labelim.zsize());
+  const int64_t mapx(region.restricted ? region.geometry.xsize() : nx);
+  const int64_t mapy(region.restricted ? region.geometry.ysize() : ny);
+  for (int64_t z=0; z<nz; z++) {
+    for (int64_t y=0; y<ny; y++) {
+      const int64_t row((z*ny+y)*nx), maprow(((z+region.z0)*mapy+y+region.y0)*mapx+region.x0);
+      for (int64_t x=0; x<nx; x++) {
+	const int64_t idx(row+x), out(maprow+x);
+	const labelOutputs<T>& entry(table[lab[idx]]);
+	if (index) index[out]=entry.index;
+	if (size) size[out]=entry.size;
+	if (maxv) maxv[out]=entry.maxval;
+	if (mean) mean[out]=entry.meanval;
+	if (logp) logp[out]=entry.logpval;
+	// Input values inside the reported clusters, 0 elsewhere
+	if (thr) thr[out]=((T) (entry.index!=0))*zptr[idx];
+      }
+    }
+  }
+}
+
+// Compresses and writes the requested maps in parallel
+template <class T>
+void write_output_maps(const clusterJob& job, outputMaps<T>& maps)
+{
+  vector<std::thread> writers;
+  vector<std::exception_ptr> errors(7);
+  maps.index.setDisplayMaximumMinimum(0,0);
+  maps.size.setDisplayMaximumMinimum(0,0);
+  maps.max.setDisplayMaximumMinimum(0,0);
+  maps.mean.setDisplayMaximumMinimum(0,0);
+  maps.logp.setDisplayMaximumMinimum(0,0);
+  maps.thresh.setDisplayMaximumMinimum(0,0);
+  maps.lmax.setDisplayMaximumMinimum(0,0);
+  if (job.outindex.size()) writers.push_back(std::thread(save_output_volume<int>,std::cref(maps.index),std::cref(job.outindex),std::ref(errors[0])));
+  if (job.outsize.size()) writers.push_back(std::thread(save_output_volume<int>,std::cref(maps.size),std::cref(job.outsize),std::ref(errors[1])));
+  if (job.outmax.size()) writers.push_back(std::thread(save_output_volume<T>,std::cref(maps.max),std::cref(job.outmax),std::ref(errors[2])));
+  if (job.outmean.size()) writers.push_back(std::thread(save_output_volume<float>,std::cref(maps.mean),std::cref(job.outmean),std::ref(errors[3])));
+  if (job.outpvals.size()) writers.push_back(std::thread(save_output_volume<float>,std::cref(maps.logp),std::cref(job.outpvals),std::ref(errors[4])));
+  if (job.outthresh.size()) writers.push_back(std::thread(save_output_volume<T>,std::cref(maps.thresh),std::cref(job.outthresh),std::ref(errors[5])));
+  if (job.outlmaxim.size()) writers.push_back(std::thread(save_output_volume<char>,std::cref(maps.lmax),std::cref(job.outlmaxim),std::ref(errors[6])));
+  std::for_each(writers.begin(),writers.end(),std::mem_fn(&std::thread::join));
+  for (unsigned int n=0; n<errors.size(); n++)
+    if (errors[n]) std::rethrow_exception(errors[n]);
+}
+
+// Thresholds and labels one statistic image that has been read in (with its
+// cope and empiricalNull images, if the job has them), writes its table to out
+// and its peak list to lmaxfile, and fills the requested maps
+template <class T>
+void cluster_image(const clusterJob& job, const volume<T>& zvol, const volume<T>& cope,
+		   const volume<float>& empiricalP, const imageRegion<T>& region,
+		   const referenceSpace<T>& space, ostream& out, ostream& lmaxfile, outputMaps<T>& maps)
+{
+  volume<int> labelim;
+  float th = thresh.value();
+  if (verbose.value())  print_volume_info(zvol,"Zvol");
+
+  if ( fractional.value() ) {
+    float frac = th;
+    th = frac*(zvol.robustmax() - zvol.robustmin()) + zvol.robustmin();
+  }
+  if ( twotailedmode.value() ) th=fabs(th);
+
+  // Threshold the input volume using thresh value (--thresh option)
+  // For cluster-wise threshold this correspond to the cluster-forming
+  // threshold. For voxel-wise threshold this is the only thresholding we need.
+  // Thresholding, labelling and the cluster statistics (of the input and
+  // of the cope image, if entered) are all done in the same sweep.
+  const bool doCope(!job.copename.empty()), doEmpirical(!job.empiricalname.empty());
+  vector<cluster<T> > clusters, clustersCope;
+  if ( doEmpirical ) {
+    label_clusters(zvol,empiricalP,(T) th,minv.value(),false,region.mask,cope,doCope,numconnected.value(),labelim,clusters,clustersCope);
+  } else {
+    label_clusters(zvol,zvol,(T) th,minv.value(),twotailedmode.value(),region.mask,cope,doCope,numconnected.value(),labelim,clusters,clustersCope);
+  }
+  if (verbose.value())  print_volume_info(labelim,"Labelim");
+
+  int nOriginalLabels(clusters.size()+1); //0 is also a label of sorts
+  if (verbose.value()) cout<<"Number of labels = "<<clusters.size()<<endl;
+
+  clusterNull null;
+  if ( nullstack.set() ) build_cluster_null(nullstack.value(),zvol,(T) th,null);
+  if ( twotailedmode.value() ) {
+    // Each tail is selected as its own run would be (the negative one as for the
+    // negated input, so with the same p-values), then the negative clusters are stored first
+    vector<cluster<T> > negClusters, negClustersCope;
+    unsigned int npos(0);
+    for (unsigned int n=0; n<clusters.size(); n++) {
+      if (clusters[n].negative) {
+	negClusters.push_back(clusters[n]);
+	if (doCope) negClustersCope.push_back(clustersCope[n]);
+      } else {
+	clusters[npos]=clusters[n];
+	if (doCope) clustersCope[npos]=clustersCope[n];
+	npos++;
+      }
+    }
+    clusters.resize(npos);
+    if (doCope) clustersCope.resize(npos);
+    select_clusters(clusters,clustersCope,th,zvol,empiricalP,doEmpirical,null,true,out);
+    select_clusters(negClusters,negClustersCope,th,zvol,empiricalP,doEmpirical,null,false,out);
+    clusters.insert(clusters.begin(),negClusters.begin(),negClusters.end());
+    if (doCope) clustersCope.insert(clustersCope.begin(),negClustersCope.begin(),negClustersCope.end());
+  }
+  else select_clusters(clusters,clustersCope,th,zvol,empiricalP,doEmpirical,null,true,out);
   if (verbose.value()) {cout<<clusters.size()<<" labels in sortedidx"<<endl;}
 
   // print table
-  print_results(clusters, clustersCope, zvol, cope, labelim, empiricalP);
-
-  labelim.setDisplayMaximumMinimum(0,0);
-  // save relevant volumes
-  if ( outindex.set() ) {
-    volume<int> relabeledim;
-    vector<int> indexMap(nOriginalLabels,0);
-    for (unsigned int n=0; n<clusters.size(); n++)
-      indexMap[clusters[n].originalLabel]=n+1;
-    relabel_image(labelim,relabeledim,indexMap);
-    save_volume(relabeledim,outindex.value());
-  }
-  if (outsize.set()) {
-    volume<int> relabeledim;
-    vector<int> sizeMap(nOriginalLabels,0);
-    for (unsigned int n=0; n<clusters.size(); n++)
-      sizeMap[clusters[n].originalLabel]=clusters[n].size;
-    relabel_image(labelim,relabeledim,sizeMap);
-    save_volume(relabeledim,outsize.value());
-  }
-  if (outmax.set()) {
-    volume<T> relabeledim;
-    vector<T> maxMap(nOriginalLabels,0);
-    for (unsigned int n=0; n<clusters.size(); n++)
-      maxMap[clusters[n].originalLabel]=clusters[n].maxval;
-    relabel_image(labelim,relabeledim,maxMap);
-    save_volume(relabeledim,outmax.value());
-  }
-  if (outmean.set()) {
-    volume<float> relabeledim;
-    vector<float> meanMap(nOriginalLabels,0);
-    for (unsigned int n=0; n<clusters.size(); n++)
-      meanMap[clusters[n].originalLabel]=clusters[n].meanval;
-    relabel_image(labelim,relabeledim,meanMap);
-    save_volume(relabeledim,outmean.value());
-  }
-  if (outpvals.set()) {
-    volume<float> relabeledim;
-    vector<float> pMap(nOriginalLabels,0);
-    for (unsigned int n=0; n<clusters.size(); n++)
-      pMap[clusters[n].originalLabel]=clusters[n].logpval;
-    relabel_image(labelim,relabeledim,pMap);
-    save_volume(relabeledim,outpvals.value());
-    }
-  if (!outthresh.unset()) {
-    // Threshold the input volume st it is 0 for all non-clusters
-    //   and maintains the same values otherwise
-    volume<T> lcopy;
-    vector<int> indexMap(nOriginalLabels,0);
-    for (unsigned int n=0; n<clusters.size(); n++)
-      indexMap[clusters[n].originalLabel]=n+1;
-    relabel_image(labelim,lcopy,indexMap);
-    lcopy.binarise(1);
-    save_volume(lcopy*zvol,outthresh.value());
+  print_results(clusters, clustersCope, zvol, labelim, region, space, job, out, lmaxfile, maps.lmax);
+
+  fill_output_maps(job,clusters,nOriginalLabels,labelim,zvol,region,maps);
+}
+
+// Reads one statistic image (or its --roi/--roimask block), clusters it,
+// writes its table to out and saves the requested peak list and maps
+template <class T>
+int process_image(const clusterJob& job, const referenceSpace<T>& space, ostream& out)
+{
+  volume<T> zvol, cope;
+  volume<float> empiricalP;
+  imageRegion<T> region;
+  find_region(job.inputname,region);
+  read_block(zvol,job.inputname,region);
+  // voxels outside --roimask are zeroed, so peaks are found as in a masked input
+  if (region.mask.nvoxels()) {
+    for (int64_t z=0; z<zvol.zsize(); z++)
+      for (int64_t y=0; y<zvol.ysize(); y++)
+	for (int64_t x=0; x<zvol.xsize(); x++)
+	  if (!region.mask(x,y,z)) zvol(x,y,z)=0;
   }
+  if (!job.copename.empty()) read_block(cope,job.copename,region);
+  if (!job.empiricalname.empty()) read_block(empiricalP,job.empiricalname,region);
+
+  ofstream lmaxfile;
+  if (job.outlmax.size()) {
+    lmaxfile.open(job.outlmax.c_str());
+    if (!lmaxfile)
+      cerr << "Could not open file " << job.outlmax << " for writing" << endl;
+  }
+  outputMaps<T> maps;
+  cluster_image(job,zvol,cope,empiricalP,region,space,out,lmaxfile,maps);
+  lmaxfile.close();
+  write_output_maps(job,maps);
 
   return 0;
 }
 
+// Worker of the --batch thread pool: takes the next unprocessed job until none are left
+template <class T>
+void batch_worker(const vector<clusterJob>& jobs, const referenceSpace<T>& space,
+		  std::atomic<unsigned int>& next, vector<string>& tables, vector<string>& errors)
+{
+  for (unsigned int n=next++; n<jobs.size(); n=next++) {
+    ostringstream table;
+    try {
+      process_image(jobs[n],space,table);
+      if (jobs[n].outtable.size()) {
+	ofstream tablefile(jobs[n].outtable.c_str());
+	if (!tablefile) errors[n]="Could not open file "+jobs[n].outtable+" for writing";
+	tablefile << table.str();
+      }
+      else tables[n]=table.str();
+    } catch (std::exception& e) {
+      errors[n]=e.what();
+    }
+  }
+}
+
+// Processes all manifest entries, sharing one copy of the reference space
+// (--xfm, --stdvol, --warpvol) between --nthr threads. Tables that are not
+// written to an --otable file are printed in manifest order.
+template <class T>
+int run_batch(const vector<clusterJob>& jobs, const referenceSpace<T>& space)
+{
+  vector<string> tables(jobs.size()), errors(jobs.size());
+  std::atomic<unsigned int> next(0);
+  unsigned int nthr(Max(1,Min(nthreads.value(),(int) jobs.size())));
+  std::vector<std::thread> threads(nthr-1); // + main thread makes nthr
+  for (unsigned int t=0; t<nthr-1; t++)
+    threads[t] = std::thread(batch_worker<T>,std::cref(jobs),std::cref(space),std::ref(next),std::ref(tables),std::ref(errors));
+  batch_worker(jobs,space,next,tables,errors);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+  int status(0);
+  bool first(true);
+  for (unsigned int n=0; n<jobs.size(); n++) {
+    if (errors[n].size()) {
+      cerr << "Error processing " << jobs[n].inputname << " : " << errors[n] << endl;
+      status=EXIT_FAILURE;
+    }
+    else if (tables[n].size()) {
+      cout << (first ? "" : "\n") << "Image\t" << jobs[n].inputname << endl << tables[n];
+      first=false;
+    }
+  }
+  return status;
+}
+
+// Copies the map of one volume into volume t of the 4D map
+template <class S>
+void insert_map(const volume<S>& map, const int64_t t, volume<S>& maps)
+{
+  if (map.totalElements()) std::copy(map.fbegin(),map.fend(),maps.nsfbegin()+t*map.totalElements());
+}
+
+// Worker for a 4D input: reads the next volume (and cope volume) in turn and
+// clusters it, keeping its table and peak list and copying its maps into the
+// 4D maps, both under the reading lock. A failed read sets failed, under the
+// same lock, and stops every worker.
+template <class T>
+void volume_worker(volumeStream& input, volumeStream* copes, std::mutex& reading, bool& failed, const clusterJob& job,
+		   const referenceSpace<T>& space, vector<string>& tables, vector<string>& peaks,
+		   outputMaps<T>& maps, vector<string>& errors)
+{
+  volume<T> zvol, cope;
+  const volume<float> noEmpirical;
+  const imageRegion<T> wholeImage;
+  while (true) {
+    int64_t t;
+    {
+      std::lock_guard<std::mutex> lock(reading);
+      if (failed) return;
+      t=input.volumesRead();
+      try {
+	if (!input.read_next_volume(zvol)) return;
+	if (copes) copes->read_next_volume(cope);
+      } catch (std::exception& e) {
+	// the streams cannot be continued
+	errors[t]=e.what();
+	failed=true;
+	return;
+      }
+    }
+    ostringstream table, peaklist;
+    try {
+      if (copes && !samesize(zvol,cope))
+	imthrow("Volume "+num2str(t)+" of "+job.copename+" does not match the size of the input",3);
+      outputMaps<T> volumeMaps;
+      cluster_image(job,zvol,cope,noEmpirical,wholeImage,space,table,peaklist,volumeMaps);
+      std::lock_guard<std::mutex> lock(reading);
+      insert_map(volumeMaps.index,t,maps.index);
+      insert_map(volumeMaps.size,t,maps.size);
+      insert_map(volumeMaps.max,t,maps.max);
+      insert_map(volumeMaps.mean,t,maps.mean);
+      insert_map(volumeMaps.logp,t,maps.logp);
+      insert_map(volumeMaps.thresh,t,maps.thresh);
+      insert_map(volumeMaps.lmax,t,maps.lmax);
+    } catch (std::exception& e) {
+      errors[t]=e.what();
+    }
+    tables[t]=table.str();
+    peaks[t]=peaklist.str();
+  }
+}
+
+// Clusters every volume of a 4D --in (and matching 4D --cope) image on --nthr
+// threads that share the reference space. Tables and peak lists are printed
+// in volume order and the maps are written as 4D images.
+template <class T>
+int run_volumes(const referenceSpace<T>& space)
+{
+  const clusterJob job(command_line_job());
+  volumeStream input(job.inputname);
+  std::unique_ptr<volumeStream> copes;
+  if (!job.copename.empty()) {
+    copes.reset(new volumeStream(job.copename));
+    if (copes->nvolumes()!=input.nvolumes())
+      imthrow(job.copename+" does not have as many volumes as "+job.inputname,3);
+  }
+  const int64_t nvols(input.nvolumes());
+
+  // 4D maps with the geometry of the input; every volume is copied in whole
+  volume<T> header;
+  read_volume_hdr_only(header,job.inputname);
+  outputMaps<T> maps;
+  if (job.outindex.size()) copyconvert(header,maps.index,false);
+  if (job.outsize.size()) copyconvert(header,maps.size,false);
+  if (job.outmax.size()) copyconvert(header,maps.max,false);
+  if (job.outmean.size()) copyconvert(header,maps.mean,false);
+  if (job.outpvals.size()) copyconvert(header,maps.logp,false);
+  if (job.outthresh.size()) copyconvert(header,maps.thresh,false);
+  if (job.outlmaxim.size()) copyconvert(header,maps.lmax,false);
+
+  vector<string> tables(nvols), peaks(nvols), errors(nvols);
+  std::mutex reading;
+  bool failed(false);
+  const int nthr(Max(1,(int) Min((int64_t) nthreads.value(),nvols)));
+  std::vector<std::thread> threads(nthr-1); // + main thread makes nthr
+  for (int t=0; t<nthr-1; t++)
+    threads[t] = std::thread(volume_worker<T>,std::ref(input),copes.get(),std::ref(reading),std::ref(failed),std::cref(job),std::cref(space),
+			     std::ref(tables),std::ref(peaks),std::ref(maps),std::ref(errors));
+  volume_worker(input,copes.get(),reading,failed,job,space,tables,peaks,maps,errors);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+  int status(0);
+  for (int64_t t=0; t<nvols; t++) {
+    if (errors[t].size()) {
+      cerr << "Error processing volume " << t << " of " << job.inputname << " : " << errors[t] << endl;
+      status=EXIT_FAILURE;
+    }
+    else if (tables[t].size())
+      cout << (t ? "\n" : "") << "Volume\t" << t << endl << tables[t];
+  }
+  if (status) return status;
+  if (job.outlmax.size()) {
+    ofstream lmaxfile(job.outlmax.c_str());
+    if (!lmaxfile)
+      cerr << "Could not open file " << job.outlmax << " for writing" << endl;
+    for (int64_t t=0; t<nvols; t++)
+      lmaxfile << (t ? "\n" : "") << "Volume\t" << t << endl << peaks[t];
+  }
+  write_output_maps(job,maps);
+  return status;
+}
+
+// Heights are stepped from zero as in tfce() (fslmaths -tfce), but voxels on
+// the image border are enhanced as well. Only voxels above zero go into the
+// tree, since the rest are not enhanced.
+template <class T>
+int tfce_image()
+{
+  volume<T> zvol;
+  read_volume(zvol,inputname.value());
+  if (verbose.value())  print_volume_info(zvol,"Zvol");
+  const float maxT(zvol.max());
+  const float dh( (tfceDh.value()==0) ? maxT/100.0 : tfceDh.value() );
+  if ( dh<=0 ) {
+    cerr << "TFCE height step must be positive: the image maximum is " << maxT << endl;
+    return EXIT_FAILURE;
+  }
+  vector<float> heights;
+  for (float h=0; h<(maxT+dh); h+=dh) heights.push_back(h);
+  componentTree<T> tree(zvol,0,false,numconnected.value(),true);
+  volume<float> enhanced;
+  tree.tfce(heights,tfceH.value(),tfceE.value(),nthreads.value(),enhanced);
+  save_volume(enhanced,outtfce.value());
+  return EXIT_SUCCESS;
+}
+
+template <class T>
+int fmrib_main(int argc, char *argv[])
+{
+  if ( tfcemode.value() ) return tfce_image<T>();
+  referenceSpace<T> space;
+  if ( threshlist.set() ) {
+    volume<T> zvol;
+    read_volume(zvol,inputname.value());
+    if (verbose.value())  print_volume_info(zvol,"Zvol");
+    read_reference_space(space);
+    return threshold_sweep(zvol,space);
+  }
+  read_reference_space(space);
+  if ( batchname.set() ) return run_batch(batchJobs,space);
+  if ( nInputVolumes>1 ) return run_volumes(space);
+  return process_image(command_line_job(),space,cout);
+}
+
 
 
 int main(int argc,char *argv[])
@@ -641,7 +1792,9 @@ int main(int argc,char *argv[])
 
   try {
     options.add(inputname);
+    options.add(batchname);
     options.add(thresh);
+    options.add(threshlist);
     options.add(outindex);
     options.add(outthresh);
     options.add(outlmax);
@@ -653,10 +1806,13 @@ int main(int argc,char *argv[])
     options.add(pthresh);
     options.add(peakdist);
     options.add(copename);
+    options.add(roibox);
+    options.add(roimask);
     options.add(voxvol);
     options.add(dLh);
     options.add(resels);
     options.add(fractional);
+    options.add(twotailedmode);
     options.add(numconnected);
     options.add(mm);
     options.add(minv);
@@ -673,6 +1829,13 @@ int main(int argc,char *argv[])
     options.add(voxthresh);
     options.add(voxuncthresh);
     options.add(empirical);
+    options.add(nullstack);
+    options.add(nthreads);
+    options.add(tfcemode);
+    options.add(outtfce);
+    options.add(tfceH);
+    options.add(tfceE);
+    options.add(tfceDh);
 
     options.parse_command_line(argc, argv);
 
@@ -682,11 +1845,140 @@ int main(int argc,char *argv[])
 	exit(EXIT_FAILURE);
       }
 
-    if ( (!pthresh.unset()) && (dLh.unset() || voxvol.unset()) )
+    if ( inputname.unset() == batchname.unset() )
+      {
+	options.usage();
+	cerr << endl
+	     << "Exactly one of --in and --batch MUST be set."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( tfcemode.value() && ( outtfce.unset() || batchname.set() || thresh.set() || threshlist.set() ||
+			       minv.set() || copename.set() || empirical.set() || outindex.set() ||
+			       outthresh.set() || outlmax.set() || outlmaxim.set() || outsize.set() ||
+			       outmax.set() || outmean.set() || outpvals.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "--tfce needs --otfce and replaces clustering: it cannot be used with --batch, --thresh, --threshlist, --min, --cope, --empiricalNull or any other output option."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( !tfcemode.value() && ( thresh.unset() == threshlist.unset() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "Exactly one of --thresh and --threshlist MUST be set."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    vector<float> thresholds;
+    if ( threshlist.set() && !parse_threshold_list(threshlist.value(),thresholds) )
+      {
+	options.usage();
+	cerr << endl
+	     << "Could not parse --threshlist: expected values and/or start:step:stop ranges separated by commas."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( threshlist.set() && ( copename.set() || empirical.set() || outindex.set() || outthresh.set() ||
+			       outlmax.set() || outlmaxim.set() || outsize.set() || outmax.set() ||
+			       outmean.set() || outpvals.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "--threshlist only produces cluster tables: it cannot be used with --cope, --empiricalNull or any output image/file option."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( batchname.set() && ( threshlist.set() || copename.set() || empirical.set() || outindex.set() ||
+			      outthresh.set() || outlmax.set() || outlmaxim.set() || outsize.set() ||
+			      outmax.set() || outmean.set() || outpvals.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "--batch takes the cope, empiricalNull and output filenames from the manifest: it cannot be used with --threshlist or with these options."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    string manifestError;
+    if ( batchname.set() && !parse_manifest(batchname.value(),batchJobs,manifestError) )
+      {
+	cerr << manifestError << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( nthreads.value()<1 )
+      {
+	options.usage();
+	cerr << endl
+	     << "--nthr must be at least 1."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( twotailedmode.value() && ( minv.value() || threshlist.set() || tfcemode.value() ||
+				    nullstack.set() || empirical.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "--twotailed cannot be used with --min, --threshlist, --tfce, --nullstack or --empiricalNull."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( inputname.set() ) {
+      int64_t sx, sy, sz, s5, s6, s7;
+      read_volume_size(inputname.value(),sx,sy,sz,nInputVolumes,s5,s6,s7);
+    }
+    if ( nInputVolumes>1 && ( threshlist.set() || tfcemode.value() || nullstack.set() || empirical.set() ||
+			      roibox.set() || roimask.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "A 4D --in is clustered volume by volume: it cannot be used with --threshlist, --tfce, --nullstack, --empiricalNull, --roi or --roimask."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( roibox.set() && roibox.value().size()!=6 )
+      {
+	options.usage();
+	cerr << endl
+	     << "--roi takes six comma-separated values: x0,x1,y0,y1,z0,z1."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( ( roibox.set() || roimask.set() ) && ( threshlist.set() || tfcemode.value() || nullstack.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "--roi and --roimask cannot be used with --threshlist, --tfce or --nullstack."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( nullstack.set() && ( batchname.set() || threshlist.set() || tfcemode.value() || empirical.set() ) )
+      {
+	options.usage();
+	cerr << endl
+	     << "--nullstack cannot be used with --batch, --threshlist, --tfce or --empiricalNull."
+	     << endl;
+	exit(EXIT_FAILURE);
+      }
+
+    if ( (!pthresh.unset()) && nullstack.unset() && (dLh.unset() || voxvol.unset()) )
       {
 	options.usage();
 	cerr << endl
-	     << "Both --dlh and --volume MUST be set if --pthresh is used."
+	     << "Both --dlh and --volume MUST be set if --pthresh is used (unless --nullstack is)."
 	     << endl;
 	exit(EXIT_FAILURE);
       }
@@ -717,6 +2009,7 @@ int main(int argc,char *argv[])
     cerr << e.what() << endl;
   }
 
-  return call_fmrib_main(dtype(inputname.value()),argc,argv);
+  // All --batch images are read with the data type of the first one
+  return call_fmrib_main(dtype(batchname.set() ? batchJobs[0].inputname : inputname.value()),argc,argv);
 
 }
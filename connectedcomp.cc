@@ -15,13 +15,96 @@ using namespace NEWIMAGE;
 
 /////////////////////////////////////////////////////////////////////////////
 
+// Labelling without holding the image in memory: slabs of nslices planes are
+// read in turn into planes 1.. of values, after the last plane of the slab
+// before, and given provisional labels by label_slab(), which does not look
+// below plane 1. The first pass joins the slabs' components across plane 0 in
+// a labelForest; the second labels the slabs again, identically, and writes
+// their final labels. Only the forest grows with the image.
+
+// Reads and labels the next slab, returning its number of planes (0 at the end)
+int64_t label_next_slab(volumeStream& stream, const int64_t nslices, volume<float>& values, volume<int>& labels,
+			const int num_connect, vector<int64_t>& slabLabel, int64_t& ncomponents)
+{
+  volume<float> slab;
+  if (stream.volumesRead()>0 || !stream.read_next_slab(slab,nslices)) return 0;
+  const int64_t plane(values.xsize()*values.ysize());
+  std::copy(slab.fbegin(),slab.fbegin()+slab.nvoxels(),values.nsfbegin()+plane);
+  label_slab(values,labels.nsfbegin(),num_connect,1,slab.zsize()+1,slabLabel,ncomponents);
+  if (ncomponents<0) imthrow("connectedcomp: too many labels in one slab",3);
+  return slab.zsize();
+}
+
+template <class L>
+void write_slab_labels(const string& inname, const string& outname, const int64_t nslices, const int num_connect,
+		       const vector<int64_t>& base, const vector<int64_t>& finalLabel)
+{
+  volume<L> geometry;
+  read_volume_hdr_only(geometry,inname);
+  slabWriter writer(geometry,outname);
+  volumeStream stream(inname);
+  volume<float> values(geometry.xsize(),geometry.ysize(),nslices+1);
+  volume<int> labels(geometry.xsize(),geometry.ysize(),nslices+1);
+  values=0;
+  labels=0;
+  vector<int64_t> slabLabel;
+  int64_t ncomponents;
+  volume<L> out;
+  for (size_t s=0; s<base.size(); s++) {
+    const int64_t nz(label_next_slab(stream,nslices,values,labels,num_connect,slabLabel,ncomponents));
+    out.reinitialize(geometry.xsize(),geometry.ysize(),nz);
+    out.copyproperties(geometry);
+    const int* lab(labels.fbegin()+geometry.xsize()*geometry.ysize());
+    L* outlab(out.nsfbegin());
+    for (int64_t idx=0; idx<out.nvoxels(); idx++)
+      outlab[idx] = (lab[idx]==0) ? 0 : finalLabel[base[s]+slabLabel[lab[idx]]];
+    writer.write_next_slab(out);
+  }
+}
+
+void stream_connected_components(const string& inname, const string& outname,
+				 const int num_connect, const int64_t nslices)
+{
+  int64_t nx, ny, nz, nt, n5, n6, n7;
+  read_volume_size(inname,nx,ny,nz,nt,n5,n6,n7);
+  if (nt*n5*n6*n7>1) imthrow("connectedcomp: only 3D images can be labelled a slab at a time",3);
+  volume<float> values(nx,ny,nslices+1);
+  volume<int> labels(nx,ny,nslices+1);
+  values=0;
+  labels=0;
+  labelForest forest;
+  vector<int64_t> base, slabLabel, previousLabel;
+  volumeStream stream(inname);
+  int64_t slabsize, ncomponents, nlabels(0);
+  while ((slabsize=label_next_slab(stream,nslices,values,labels,num_connect,slabLabel,ncomponents))) {
+    base.push_back(nlabels);
+    for (int64_t n=0; n<ncomponents; n++) forest.add();
+    nlabels+=ncomponents;
+    if (base.size()>1)
+      join_slabs(values,labels.fbegin(),num_connect,1,slabLabel,base.back(),
+		 previousLabel,base[base.size()-2],forest);
+    // carry the last plane down to plane 0
+    const int64_t plane(nx*ny);
+    std::copy(values.fbegin()+slabsize*plane,values.fbegin()+(slabsize+1)*plane,values.nsfbegin());
+    std::copy(labels.fbegin()+slabsize*plane,labels.fbegin()+(slabsize+1)*plane,labels.nsfbegin());
+    previousLabel.swap(slabLabel);
+  }
+
+  vector<int64_t> finalLabel;
+  if (forest.resolve(finalLabel)<=std::numeric_limits<short>::max())
+    write_slab_labels<short>(inname,outname,nslices,num_connect,base,finalLabel);
+  else
+    write_slab_labels<int>(inname,outname,nslices,num_connect,base,finalLabel);
+}
+
 int main(int argc, char* argv[])
 {
   volume<float> invol;
   volume <int> outvol;
 
   if (argc<2) {
-    cerr << "Usage: " << argv[0] << " <in_volume> [outputvol [num_connect]]" << endl;
+    cerr << "Usage: " << argv[0] << " <in_volume> [outputvol [num_connect [num_threads [slab_thickness]]]]" << endl;
+    cerr << "With a slab_thickness, the image is read and labelled that many slices at a time" << endl;
     return -1;
   }
 
@@ -41,7 +124,33 @@ int main(int argc, char* argv[])
     }
   }
 
+  int num_threads=1;
+  if (argc>4) {
+    num_threads=atoi(argv[4]);
+    if (num_threads<1) {
+      cerr << "num_threads must be at least 1" << endl;
+      return 1;
+    }
+  }
+  if (argc>5) {
+    const int64_t slab_thickness=atol(argv[5]);
+    if (slab_thickness<1) {
+      cerr << "slab_thickness must be at least 1" << endl;
+      return 1;
+    }
+    stream_connected_components(inname,outname,num_connect,slab_thickness);
+    return 0;
+  }
+
   read_volume(invol,inname);
-  outvol = connected_components(invol,num_connect);
-  save_volume(outvol,outname);
+  // short labels, at half the memory, whenever they are sure to be enough
+  NEWMAT::ColumnVector clustersize;
+  if (component_label_bound(invol)<=std::numeric_limits<short>::max()) {
+    volume<short> shortvol;
+    connected_components(invol,shortvol,clustersize,num_connect,num_threads);
+    save_volume(shortvol,outname);
+  } else {
+    connected_components(invol,outvol,clustersize,num_connect,num_threads);
+    save_volume(outvol,outname);
+  }
 }
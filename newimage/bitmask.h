@@ -0,0 +1,68 @@
+/*  bitmask.h
+
+    Binary images stored with one bit per voxel  */
+
+/*  CCOPYRIGHT  */
+
+#if !defined(__bitmask_h)
+#define __bitmask_h
+
+#include <vector>
+#include <cstdint>
+
+
+namespace NEWIMAGE {
+
+  // A 3D binary image with one bit per voxel. Every row (fixed y and z)
+  // starts on a new 64-bit word, with voxel x in bit x%64 of word x/64, so a
+  // row can be scanned a word at a time and empty runs of 64 voxels skipped.
+  class bitmask {
+
+  private:
+    int64_t nx, ny, nz;
+    int64_t wordsPerRow;
+    std::vector<uint64_t> words;
+
+  public:
+    bitmask() : nx(0), ny(0), nz(0), wordsPerRow(0) {}
+    bitmask(int64_t xsize, int64_t ysize, int64_t zsize) { reinitialize(xsize,ysize,zsize); }
+    void reinitialize(int64_t xsize, int64_t ysize, int64_t zsize) {
+      nx=xsize; ny=ysize; nz=zsize;
+      wordsPerRow=(nx+63)/64;
+      words.assign(wordsPerRow*ny*nz,0);
+    }
+
+    inline int64_t xsize() const { return nx; }
+    inline int64_t ysize() const { return ny; }
+    inline int64_t zsize() const { return nz; }
+    inline int64_t nvoxels() const { return nx*ny*nz; }
+    inline int64_t wordsperrow() const { return wordsPerRow; }
+
+    inline uint64_t* row(int64_t y, int64_t z) { return &words[(z*ny+y)*wordsPerRow]; }
+    inline const uint64_t* row(int64_t y, int64_t z) const { return &words[(z*ny+y)*wordsPerRow]; }
+
+    inline bool operator()(int64_t x, int64_t y, int64_t z) const
+      { return (row(y,z)[x>>6] >> (x&63)) & 1; }
+    inline void set(int64_t x, int64_t y, int64_t z, bool value=true) {
+      uint64_t& word(row(y,z)[x>>6]);
+      if (value) word |= (uint64_t(1) << (x&63));
+      else word &= ~(uint64_t(1) << (x&63));
+    }
+
+    // keeps only the voxels that are also set in other, of the same size
+    bitmask& operator&=(const bitmask& other) {
+      for (size_t w=0; w<words.size(); w++) words[w] &= other.words[w];
+      return *this;
+    }
+
+    // number of voxels that are set
+    int64_t count() const {
+      int64_t n(0);
+      for (size_t w=0; w<words.size(); w++) n+=__builtin_popcountll(words[w]);
+      return n;
+    }
+  };
+
+}
+
+#endif
@@ -204,7 +204,7 @@ int read_volume_size(const string& filename,
 		     int64_t& sx, int64_t& sy, int64_t& sz, int64_t& st, int64_t& s5, int64_t& s6, int64_t& s7)
 {
   // read in sizes only
-  NiftiHeader niihdr = loadHeader(filename);
+  NiftiHeader niihdr = loadHeader(return_validimagefilename(filename));
   sx=niihdr.dim[1];
   sy=niihdr.dim[2];
   sz=niihdr.dim[3];
@@ -320,13 +320,100 @@ template int readGeneralVolume(volume<double>& target, const string& filename,
                                int64_t x1, int64_t y1, int64_t z1, int64_t t1, int64_t d51, int64_t d61, int64_t d71,
                                const bool readAs4D);
 
+volumeStream::volumeStream(const string& filename) :
+  name(return_validimagefilename(filename)), reader(name,true), nread(0), slicesRead(0)
+{
+  try {
+    header=reader.readHeader();
+    if ( !header.singleFile() ) {  // data are in the .img, compressed if the header was
+      fileIO hdrReader(name,true,false);
+      nifti_1_header truncatedHeader;
+      hdrReader.readRawBytes( &truncatedHeader, (size_t)sizeof(truncatedHeader.sizeof_hdr) );
+      bool wasCompressed( (NIFTI2_VERSION(truncatedHeader)) == 0 );
+      reader=fileIO(string(name).replace(name.rfind(".hdr"),4,".img"), true, wasCompressed);
+    }
+    reader.seek(header.nominalVoxOffset(),SEEK_SET);
+  } catch ( exception& e ) { imthrow("Failed to read volume "+filename+"\nError : "+e.what(),22); }
+  fill(header.dim.begin()+header.dim[0]+1,header.dim.end(),1);
+  // same sanity checks as readGeneralVolume
+  if ( header.isAnalyze() ) {
+    header.sX[0]=header.pixdim[1];
+    header.sY[1]=header.pixdim[2];
+    header.sZ[2]=header.pixdim[3];
+    header.sX[3]=-(header.legacyFields.origin()[0]-1)*header.pixdim[1];
+    header.sY[3]=-(header.legacyFields.origin()[1]-1)*header.pixdim[2];
+    header.sZ[3]=-(header.legacyFields.origin()[2]-1)*header.pixdim[3];
+    header.setQForm(header.getSForm());
+    header.qformCode=header.sformCode=NIFTI_XFORM_ALIGNED_ANAT;
+  }
+  for ( int i = 1; i <= header.dim[0]; i++ )
+    header.pixdim[i] = header.pixdim[i] == 0 ? 1 : fabs(header.pixdim[i]);
+  nvols=header.dim[4]*header.dim[5]*header.dim[6]*header.dim[7];
+}
+
+// Returns false, leaving target untouched, once all volumes have been read
+template <class T>
+bool volumeStream::read_next_volume(volume<T>& target)
+{
+  return read_next_slab(target,header.dim[3]-slicesRead);
+}
+
+// A slab never runs on into the next volume, so the last one of each volume
+// may be thinner than nslices
+template <class T>
+bool volumeStream::read_next_slab(volume<T>& target, const int64_t nslices)
+{
+  if ( nread>=nvols ) return false;
+  if ( nslices<1 ) imthrow("volumeStream: slabs must be at least one slice thick",22);
+  const int64_t nz(std::min(nslices,header.dim[3]-slicesRead));
+  const size_t nElements(header.dim[1]*header.dim[2]*nz);
+  char *buffer(new char[nElements*header.datumByteWidth()]);
+  try {
+    reader.readRawBytes(buffer,nElements*header.datumByteWidth());
+  } catch ( exception& e ) {
+    delete [] buffer;
+    imthrow("Failed to read volume "+num2str(nread)+" of "+name+"\nError : "+e.what(),22);
+  }
+  if ( header.wasWrongEndian )
+    byteSwap(header.datumByteWidth(),buffer,nElements);
+  T* tbuffer;
+  ConvertAndScaleNewNiftiBuffer(buffer,tbuffer,header,nElements);  // buffer will get deleted inside (unless T=char)
+  int64_t nthreads = target.nthreads();
+  target.destroy();
+  target.initialize(header.dim[1],header.dim[2],nz,1,1,1,1,tbuffer,true,nthreads);
+  set_volume_properties(header,target);
+  if ( slicesRead>0 ) {
+    Matrix offset(IdentityMatrix(4));
+    offset(3,4)=slicesRead;
+    target.set_sform(target.sform_code(),target.sform_mat()*offset);
+    target.set_qform(target.qform_code(),target.qform_mat()*offset);
+  }
+  if (!target.RadiologicalFile) target.makeradiological();
+  slicesRead+=nz;
+  if ( slicesRead==header.dim[3] ) {
+    slicesRead=0;
+    nread++;
+  }
+  return true;
+}
+
+template bool volumeStream::read_next_volume(volume<char>& target);
+template bool volumeStream::read_next_volume(volume<short>& target);
+template bool volumeStream::read_next_volume(volume<int>& target);
+template bool volumeStream::read_next_volume(volume<float>& target);
+template bool volumeStream::read_next_volume(volume<double>& target);
+template bool volumeStream::read_next_slab(volume<char>& target, const int64_t nslices);
+template bool volumeStream::read_next_slab(volume<short>& target, const int64_t nslices);
+template bool volumeStream::read_next_slab(volume<int>& target, const int64_t nslices);
+template bool volumeStream::read_next_slab(volume<float>& target, const int64_t nslices);
+template bool volumeStream::read_next_slab(volume<double>& target, const int64_t nslices);
+
+// The header that saving source as filetype writes
 template <class V>
-int save_unswapped_vol(const V& source, const string& filename, int filetype,int bitsPerVoxel)
+NiftiHeader output_header(const V& source, const int filetype, int bitsPerVoxel)
 {
   NiftiHeader header;
   set_fsl_hdr(source,header);
-  if ( filetype<0 )
-    filetype=FslGetEnvOutputType();
   header.description=BUILDSTRING;
   header.setNiftiVersion(FslNiftiVersionFileType(filetype),FslIsSingleFileType(filetype));
   header.bitsPerVoxel=bitsPerVoxel;
@@ -342,10 +429,68 @@ int save_unswapped_vol(const V& source, const string& filename, int filetype,int
     }
     header.pixdim[1]*=-1;
   }
+  return header;
+}
+
+template <class V>
+int save_unswapped_vol(const V& source, const string& filename, int filetype,int bitsPerVoxel)
+{
+  if ( filetype<0 )
+    filetype=FslGetEnvOutputType();
+  NiftiHeader header(output_header(source,filetype,bitsPerVoxel));
   NiftiIO::saveImage(make_basename(filename)+outputExtension(filetype), (const char *)source.fbegin(), source.extensions, header, FslIsCompressedFileType(filetype));
   return 0;
 }
 
+// The header (and, for pairs, the .img) is opened and written as saveImage()
+// does, without extensions, leaving the data to write_next_slab()
+template <class T>
+slabWriter::slabWriter(const volume<T>& geometry, const string& filename, const int filetype) :
+  outputType(filetype<0 ? FslGetEnvOutputType() : filetype),
+  name(make_basename(filename)+outputExtension(outputType)),
+  writer(name,false,FslIsCompressedFileType(outputType)), nwritten(0)
+{
+  const bool swapped( !geometry.RadiologicalFile && geometry.left_right_order()==FSL_RADIOLOGICAL );
+  if (swapped) const_cast< volume <T>& > (geometry).makeneurological(true);
+  header=output_header(geometry,outputType,sizeof(T)*8);
+  if (swapped) const_cast< volume <T>& > (geometry).makeradiological(true);
+  try {
+    header.vox_offset = header.singleFile() ? header.sizeof_hdr+4 : 0;
+    writer.writeHeader(header);
+    if ( !header.isAnalyze() )
+      writer.writeExtensions(header,vector<NiftiExtension>());
+    if ( !header.singleFile() )
+      writer=fileIO(string(name).replace(name.rfind(".hdr"),4,".img"),false,FslIsCompressedFileType(outputType));
+  } catch ( exception& e ) { imthrow("Failed to write volume "+name+"\nError : "+e.what(),22); }
+}
+
+template <class T>
+void slabWriter::write_next_slab(const volume<T>& slab)
+{
+  if ( slab.xsize()!=header.dim[1] || slab.ysize()!=header.dim[2] || dtype(slab)!=header.datatype )
+    imthrow("slabWriter: slab does not match the image being written to "+name,22);
+  if ( nwritten+slab.zsize()*slab.tsize() > (int64_t) (header.nElements()/(header.dim[1]*header.dim[2])) )
+    imthrow("slabWriter: more slices than the image being written to "+name,22);
+  const bool swapped( !slab.RadiologicalFile && slab.left_right_order()==FSL_RADIOLOGICAL );
+  if (swapped) const_cast< volume <T>& > (slab).makeneurological();
+  try {
+    writer.writeRawBytes(slab.fbegin(),slab.nvoxels()*slab.tsize()*sizeof(T));
+  } catch ( exception& e ) { imthrow("Failed to write volume "+name+"\nError : "+e.what(),22); }
+  if (swapped) const_cast< volume <T>& > (slab).makeradiological();
+  nwritten+=slab.zsize()*slab.tsize();
+}
+
+template slabWriter::slabWriter(const volume<char>& geometry, const string& filename, const int filetype);
+template slabWriter::slabWriter(const volume<short>& geometry, const string& filename, const int filetype);
+template slabWriter::slabWriter(const volume<int>& geometry, const string& filename, const int filetype);
+template slabWriter::slabWriter(const volume<float>& geometry, const string& filename, const int filetype);
+template slabWriter::slabWriter(const volume<double>& geometry, const string& filename, const int filetype);
+template void slabWriter::write_next_slab(const volume<char>& slab);
+template void slabWriter::write_next_slab(const volume<short>& slab);
+template void slabWriter::write_next_slab(const volume<int>& slab);
+template void slabWriter::write_next_slab(const volume<float>& slab);
+template void slabWriter::write_next_slab(const volume<double>& slab);
+
 template <class T>
 int save_basic_volume(const volume<T>& source, const string& filename,
 			int filetype, bool noSwapping)
@@ -2156,11 +2156,11 @@ namespace NEWIMAGE {
 
 
   template <class T>
-  void volume<T>::makeneurological()
+  void volume<T>::makeneurological(const bool headerOnly)
   {
     // use existing matrices to determine the order and if necessary swap
     //  all data and matrices
-    if (this->left_right_order()==FSL_RADIOLOGICAL) { this->swapLRorder(); }
+    if (this->left_right_order()==FSL_RADIOLOGICAL) { this->swapLRorder(headerOnly); }
   }
 
 
@@ -191,6 +191,8 @@ int readGeneralVolume(volume<T>& target, const std::string& filename,
     template <class S> friend
       int read_volume_hdr_only(volume<S>&, const std::string&);
 
+    friend class volumeStream;
+
     void basic_swapdimensions(int dim1, int dim2, int dim3, bool keepLRorder, const bool headerOnly=false);
 
 //#ifdef EXPOSE_TREACHEROUS
@@ -206,7 +208,7 @@ int readGeneralVolume(volume<T>& target, const std::string& filename,
     void swapLRorder(const bool headerOnly=false);
     void setLRorder(int LRorder);
     void makeradiological(const bool headerOnly=false);
-    void makeneurological();
+    void makeneurological(const bool headerOnly=false);
     NEWMAT::Matrix sform_mat() const { return StandardSpaceCoordMat; }
     int sform_code() const { return StandardSpaceTypeCode; }
     NEWMAT::Matrix qform_mat() const { return RigidBodyCoordMat; }
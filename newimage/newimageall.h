@@ -13,6 +13,7 @@
 #include "newimage.h"
 #include "newimageio.h"
 #include "newimagefns.h"
+#include "bitmask.h"
 #include "complexvolume.h"
 #include "imfft.h"
 
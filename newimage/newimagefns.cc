@@ -795,56 +795,26 @@ float fsllog2(float x)
     }
 
 
-  inline void get_parent_label(int& idx, const Matrix& idxmap)
-  {
-    while (idxmap(idx,1)>0.0) { idx = MISCMATHS::round(float(idxmap(idx,1))); }
-  }
-
-
   void relabel_components_uniquely(volume<int>& labelvol,
 				   const std::vector<int>& equivlista,
 				   const std::vector<int>& equivlistb, ColumnVector& clustersizes)
   {
-    int labelnum = labelvol.max();
-    Matrix emap(labelnum,1);
-    emap = -0.2;
-
-    int n1, n2;
-    for (unsigned int n=0; n<equivlista.size(); n++) {
-      n1 = equivlista[n];
-      get_parent_label(n1,emap);
-      n2 = equivlistb[n];
-      get_parent_label(n2,emap);
-      if (n1!=n2) emap(Max(n1,n2),1) = Min(n1,n2);
-    }
+    labelForest forest(labelvol.max());
+    for (unsigned int n=0; n<equivlista.size(); n++)
+      forest.join(equivlista[n],equivlistb[n]);
 
-    // re-parse emap to assign sequential, unique numbers
-    int newlabel=1;
-    for (int n=1; n<=labelnum; n++) {
-      int n1 = n;
-      get_parent_label(n1,emap);
-      if (n1<n) {  // it points to another label
-	emap(n,1) = emap(n1,1);
-      } else {  // it is a newly found label
-	emap(n,1) = -newlabel;
-	newlabel++;
-      }
-    }
-
-    int numclusts=newlabel-1;
-    clustersizes.ReSize(numclusts);
+    // sequential, unique numbers in order of the smallest label of each set
+    std::vector<int64_t> finalLabel;
+    clustersizes.ReSize(forest.resolve(finalLabel));
     clustersizes=0;
 
     // Change the old labels to new ones
-
-    for (int z=0; z<labelvol.zsize(); z++)
-      for (int y=0; y<labelvol.ysize(); y++)
-	for (int x=0; x<labelvol.xsize(); x++)
-	  if (labelvol(x,y,z)>0) {
-	    int tmp = MISCMATHS::round(-float(emap(labelvol(x,y,z),1)));
-	    labelvol(x,y,z)=tmp;
-	    clustersizes(tmp)+=1;
-	  }
+    int* lab(labelvol.nsfbegin());
+    for (int64_t idx=0; idx<labelvol.nvoxels(); idx++)
+      if (lab[idx]>0) {
+	lab[idx]=finalLabel[lab[idx]];
+	clustersizes(lab[idx])+=1;
+      }
   }
 
   void relabel_components_uniquely(volume<int>& labelvol,
@@ -892,6 +862,77 @@ vector<offset> backConnectivity(int nDirections) {
   return neighbours;
 }
 
+// Labels are numbered in order of first raster occurrence, as the other
+// connected_components() number them. Provisional labels are joined with a
+// union-find whose roots are always the smallest label, and only the set
+// bits of each row are visited.
+void connected_components(const bitmask& mask, volume<int>& labelvol,
+			  ColumnVector& clustersize, int numconnected)
+{
+  const int64_t nx(mask.xsize()), ny(mask.ysize()), nz(mask.zsize());
+  if ( labelvol.xsize()!=nx || labelvol.ysize()!=ny || labelvol.zsize()!=nz || labelvol.tsize()!=1 )
+    labelvol.reinitialize(nx,ny,nz);
+  labelvol=0;
+  vector<offset> neighbours(backConnectivity(numconnected));
+  vector<int64_t> shifts;
+  for (unsigned int k=0; k<neighbours.size(); k++)
+    shifts.push_back(neighbours[k].x + nx*(neighbours[k].y + ny*neighbours[k].z));
+
+  vector<int> parent(1,0);  // label 0 is background
+  int* lab(labelvol.nsfbegin());
+  for (int64_t z=0; z<nz; z++) {
+    for (int64_t y=0; y<ny; y++) {
+      const uint64_t* row(mask.row(y,z));
+      for (int64_t w=0; w<mask.wordsperrow(); w++) {
+	for (uint64_t bits=row[w]; bits!=0; bits&=bits-1) {
+	  const int64_t x(w*64+__builtin_ctzll(bits)), idx(x+nx*(y+ny*z));
+	  int label(0);
+	  for (unsigned int k=0; k<neighbours.size(); k++) {
+	    const int64_t xn(x+neighbours[k].x), yn(y+neighbours[k].y), zn(z+neighbours[k].z);
+	    if ( xn<0 || xn>=nx || yn<0 || yn>=ny || zn<0 ) continue;
+	    int other(lab[idx+shifts[k]]);
+	    if (other==0) continue;
+	    while (parent[other]!=other) {
+	      parent[other]=parent[parent[other]];
+	      other=parent[other];
+	    }
+	    if (label==0) { label=other; continue; }
+	    if (other==label) continue;
+	    parent[Max(label,other)]=Min(label,other);
+	    label=Min(label,other);
+	  }
+	  if (label==0) {
+	    label=parent.size();
+	    parent.push_back(label);
+	  }
+	  lab[idx]=label;
+	}
+      }
+    }
+  }
+
+  // Number the roots in increasing order and resolve every provisional label
+  vector<int> finalLabel(parent.size(),0);
+  int nclusters(0);
+  for (unsigned int n=1; n<parent.size(); n++)
+    finalLabel[n] = (parent[n]==(int) n) ? ++nclusters : finalLabel[parent[n]];
+  clustersize.ReSize(nclusters);
+  clustersize=0;
+  for (int64_t z=0; z<nz; z++) {
+    for (int64_t y=0; y<ny; y++) {
+      const uint64_t* row(mask.row(y,z));
+      int* lrow(lab+nx*(y+ny*z));
+      for (int64_t w=0; w<mask.wordsperrow(); w++) {
+	for (uint64_t bits=row[w]; bits!=0; bits&=bits-1) {
+	  int& l(lrow[w*64+__builtin_ctzll(bits)]);
+	  l=finalLabel[l];
+	  clustersize(l)+=1;
+	}
+      }
+    }
+  }
+}
+
 
   ///////////////////////////////////////////////////////////////////////////
 
@@ -17,11 +17,17 @@
 #include <fstream>
 #include <sstream>
 #include <queue>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <utility>
+#include <type_traits>
 #include "armawrap/newmat.h"
 #include "miscmaths/miscmaths.h"
 #include "newimage.h"
 #include "complexvolume.h"
 #include "imfft.h"
+#include "bitmask.h"
 
 
 #ifndef MAX
@@ -80,6 +86,9 @@ namespace NEWIMAGE {
   volume<T> binarise(const volume<T>& vol, T lowerth, T upperth, threshtype tt=inclusive, bool invert=false);
   template <class T>
   volume<T> binarise(const volume<T>& vol, T thresh, bool invert=false);
+  // same test, one bit per voxel (3D only)
+  template <class T>
+  void binarise(const volume<T>& vol, bitmask& mask, T lowerth, T upperth, threshtype tt=inclusive, bool invert=false);
 
 
   template <class T>
@@ -314,7 +323,7 @@ namespace NEWIMAGE {
 
 
   template <class T>
-    volume<int> connected_components(const volume<T>& vol,  NEWMAT::ColumnVector& clustersize, int numconnected=26);
+    volume<int> connected_components(const volume<T>& vol,  NEWMAT::ColumnVector& clustersize, int numconnected=26, int nthreads=1);
 
   template <class T>
     volume<int> connected_components(const volume<T>& vol,
@@ -323,11 +332,113 @@ namespace NEWIMAGE {
 
   template <class T>
   volume<int> connected_components(const volume<T>& vol,
-				   int numconnected=26);
+				   int numconnected=26, int nthreads=1);
   template <class T>
   volume<int> connected_components(const volume<T>& vol,
                                    const volume<T>& mask,
                                    bool (*binaryrelation)(T , T));
+  // Labels in a volume of any integer type L, e.g. volume<short> to halve the
+  // memory of volume<int> when component_label_bound(vol) is at most 32767
+  template <class T, class L>
+  void connected_components(const volume<T>& vol, volume<L>& labelvol,
+			    NEWMAT::ColumnVector& clustersize, int numconnected=26, int nthreads=1);
+  // labelvol takes the size of the mask, keeping its properties if it already has it
+  void connected_components(const bitmask& mask, volume<int>& labelvol,
+			    NEWMAT::ColumnVector& clustersize, int numconnected=26);
+
+  // Per-component statistics for label_components(), filled in its final
+  // relabelling pass. A policy is default constructible, add()s each voxel of
+  // its component, with its value, position and whether it lies on the edge
+  // of the image, and merge()s the statistics of the same component from the
+  // next slab up. Policies are combined with componentStats<>.
+  struct componentSize {
+    int64_t size;
+    componentSize() : size(0) {}
+    template <class S>
+    void add(const S, const int64_t, const int64_t, const int64_t, const bool) { size++; }
+    void merge(const componentSize& other) { size+=other.size; }
+  };
+
+  struct componentSum {
+    double sum;
+    componentSum() : sum(0) {}
+    template <class S>
+    void add(const S val, const int64_t, const int64_t, const int64_t, const bool) { sum+=val; }
+    void merge(const componentSum& other) { sum+=other.sum; }
+  };
+
+  // at[] is the voxel of the maximum, the first in a raster scan on ties
+  template <class T>
+  struct componentMax {
+    T max;
+    int64_t at[3];
+    componentMax() : max(0) { at[0]=at[1]=at[2]=-1; }
+    void add(const T val, const int64_t x, const int64_t y, const int64_t z, const bool) {
+      if ( at[0]<0 || val>max ) { max=val; at[0]=x; at[1]=y; at[2]=z; }
+    }
+    void merge(const componentMax& other) {
+      if ( other.at[0]>=0 && (at[0]<0 || other.max>max) ) *this=other;
+    }
+  };
+
+  // voxel coordinates of the bounding box, lower[] to upper[] inclusive
+  struct componentBounds {
+    int64_t lower[3], upper[3];
+    componentBounds() {
+      lower[0]=lower[1]=lower[2]=std::numeric_limits<int64_t>::max();
+      upper[0]=upper[1]=upper[2]=-1;
+    }
+    template <class S>
+    void add(const S, const int64_t x, const int64_t y, const int64_t z, const bool) {
+      const int64_t pos[3]={x,y,z};
+      for (int d=0; d<3; d++) { lower[d]=std::min(lower[d],pos[d]); upper[d]=std::max(upper[d],pos[d]); }
+    }
+    void merge(const componentBounds& other) {
+      for (int d=0; d<3; d++) { lower[d]=std::min(lower[d],other.lower[d]); upper[d]=std::max(upper[d],other.upper[d]); }
+    }
+  };
+
+  // centre of gravity, weighted by the values, in voxel coordinates
+  struct componentCentroid {
+    double weight, moment[3];
+    componentCentroid() : weight(0) { moment[0]=moment[1]=moment[2]=0; }
+    template <class S>
+    void add(const S val, const int64_t x, const int64_t y, const int64_t z, const bool) {
+      weight+=val; moment[0]+=val*(double)x; moment[1]+=val*(double)y; moment[2]+=val*(double)z;
+    }
+    void merge(const componentCentroid& other) {
+      weight+=other.weight;
+      for (int d=0; d<3; d++) moment[d]+=other.moment[d];
+    }
+    double cog(const int d) const { return moment[d]/weight; }
+  };
+
+  struct componentEdge {
+    bool touchesEdge;
+    componentEdge() : touchesEdge(false) {}
+    template <class S>
+    void add(const S, const int64_t, const int64_t, const int64_t, const bool edge) { touchesEdge|=edge; }
+    void merge(const componentEdge& other) { touchesEdge|=other.touchesEdge; }
+  };
+
+  // e.g. componentStats<componentSize,componentMax<float> > gathers both
+  template <class... Accumulators>
+  struct componentStats : Accumulators... {
+    template <class S>
+    void add(const S val, const int64_t x, const int64_t y, const int64_t z, const bool edge)
+      { (Accumulators::add(val,x,y,z,edge), ...); }
+    void merge(const componentStats& other) { (Accumulators::merge(other), ...); }
+  };
+
+
+  // Sets in peaks those candidate voxels that are local maxima (or, with
+  // minima, local minima) of vol over their 6, 18 or 26 neighbours: strictly
+  // above the neighbours before them in raster order and at least equal to
+  // the ones after, so a plateau gives a single peak. Neighbours beyond the
+  // edge take the extrapolated values of vol.
+  template <class T>
+  void local_extrema(const volume<T>& vol, const bitmask& candidates, bitmask& peaks,
+		     int numconnected=26, bool minima=false);
 
   template <class T>
   volume<float> distancemap(const volume<T>& binaryvol);
@@ -405,6 +516,30 @@ namespace NEWIMAGE {
       return binarise(vol,lowthresh,vol.max(),inclusive, invert);
     }
 
+  template <class T>
+    void binarise(const volume<T>& vol, bitmask& mask, T lowerth, T upperth, threshtype tt, bool invert)
+    {
+      if (vol.tsize()>1) imthrow("binarise: bitmask only holds 3D images",3);
+      const int64_t nx(vol.xsize());
+      mask.reinitialize(nx,vol.ysize(),vol.zsize());
+      const T* vptr(vol.fbegin());
+      for (int64_t z=0; z<vol.zsize(); z++) {
+	for (int64_t y=0; y<vol.ysize(); y++, vptr+=nx) {
+	  uint64_t* row(mask.row(y,z));
+	  for (int64_t w=0; w<mask.wordsperrow(); w++) {
+	    const int64_t x0(w*64), x1(MIN(x0+64,nx));
+	    uint64_t word(0);
+	    for (int64_t x=x0; x<x1; x++) {
+	      const T val(vptr[x]);
+	      const bool inside( (tt==inclusive) ? ((val>=lowerth) && (val<=upperth)) : ((val>lowerth) && (val<upperth)) );
+	      word |= uint64_t(inside!=invert) << (x-x0);
+	    }
+	    row[w]=word;
+	  }
+	}
+      }
+    }
+
   template <class T>
   volume<T> threshold(const volume<T>& vol, T lowerth, T upperth, threshtype tt)
     {
@@ -1234,30 +1369,55 @@ template <class T, class S>
   }
 
 
+  // The zero voxels that cannot be reached from the edges of the image
+  // through other zero voxels are set to 1. The background is flood filled
+  // from its voxels on the edges, marking those it reaches in a bitmask.
   template <class T>
   volume<T> fill_holes(const volume<T>& im, const int connectivity)
   {
-    volume<int> mask;
+    const int64_t nx(im.xsize()), ny(im.ysize()), nz(im.zsize());
+    const int maxdist( connectivity==6 ? 1 : (connectivity==18 ? 2 : 3) );
+    std::vector<int64_t> dx, dy, dz;
+    for (int k=-1; k<=1; k++)
+      for (int j=-1; j<=1; j++)
+	for (int i=-1; i<=1; i++) {
+	  const int dist(std::abs(i)+std::abs(j)+std::abs(k));
+	  if ( dist==0 || dist>maxdist ) continue;
+	  dx.push_back(i); dy.push_back(j); dz.push_back(k);
+	}
+
+    const T* data(im.fbegin());
+    bitmask outside(nx,ny,nz);
+    std::vector<int64_t> todo;
+    for (int64_t z=0; z<nz; z++)
+      for (int64_t y=0; y<ny; y++) {
+	const bool edgeRow( z==0 || z==nz-1 || y==0 || y==ny-1 );
+	for (int64_t x=0; x<nx; x++) {
+	  if ( !edgeRow && x==1 ) x=nx-1;  // only the ends of the inner rows
+	  const int64_t idx(x+nx*(y+ny*z));
+	  if ( data[idx]==0 && !outside(x,y,z) ) { outside.set(x,y,z); todo.push_back(idx); }
+	}
+      }
+
+    while (!todo.empty()) {
+      const int64_t idx(todo.back());
+      todo.pop_back();
+      const int64_t x(idx%nx), y((idx/nx)%ny), z(idx/(nx*ny));
+      for (unsigned int k=0; k<dx.size(); k++) {
+	const int64_t xn(x+dx[k]), yn(y+dy[k]), zn(z+dz[k]);
+	if ( xn<0 || xn>=nx || yn<0 || yn>=ny || zn<0 || zn>=nz ) continue;
+	const int64_t n(xn+nx*(yn+ny*zn));
+	if ( data[n]==0 && !outside(xn,yn,zn) ) { outside.set(xn,yn,zn); todo.push_back(n); }
+      }
+    }
+
+    //Fill any zero voxel which isn't connected to the edge ( i.e. a "hole" )
     volume<T> workingImage(im);
-    std::set<int> edgelabs{0};  //For later we include 0 as an edge-label
-
-    workingImage.binarise(0,0,inclusive,false);
-
-    mask = connected_components(workingImage,connectivity);
-    // Store all labels at image edges ( including repeated 0s )
-    // Edge defined as at least one of x,y,z at limit
-    // The modulo operator will only be 0 at either edge
-    for (int z=0; z<=im.maxz(); z++)
-      for (int y=0; y<=im.maxy(); y++)
-        for (int x=0; x<=im.maxx(); x++)
-	        if ( !(x%im.maxx() && y%im.maxy() && z%im.maxz()))
-            edgelabs.insert(mask(x,y,z));
-
-    //Fill any masked voxel which isn't connected to the edge ( i.e. a "hole" )
-    for (int z=0; z<=im.maxz(); z++)
-	    for (int y=0; y<=im.maxy(); y++)
-	      for (int x=0; x<=im.maxx(); x++)
-          workingImage(x,y,z) = ( edgelabs.find(mask(x,y,z)) == edgelabs.end() ) ? 1 : im(x,y,z);
+    T* filled(workingImage.nsfbegin());
+    for (int64_t z=0, idx=0; z<nz; z++)
+      for (int64_t y=0; y<ny; y++)
+	for (int64_t x=0; x<nx; x++, idx++)
+	  if ( data[idx]==0 && !outside(x,y,z) ) filled[idx]=1;
 
     return workingImage;
   }
@@ -1914,6 +2074,88 @@ volume<T> efficient_convolve(const volume<T>& vin, const volume<S>& vker)
 				   const std::vector<int>& equivlista,
 				   const std::vector<int>& equivlistb);
 
+  // Union-find over the provisional labels 1..N (0 is the background), with
+  // path compression and union by rank. resolve() numbers the sets in order
+  // of their smallest label, i.e. of their first occurrence in a raster scan.
+  class labelForest {
+  public:
+    labelForest(int64_t nlabels=0) : parent(nlabels+1), rank(nlabels+1,0)
+      { for (int64_t n=0; n<=nlabels; n++) parent[n]=n; }
+    int64_t add() {
+      parent.push_back(parent.size());
+      rank.push_back(0);
+      return parent.size()-1;
+    }
+    int64_t find(int64_t n) {
+      int64_t root(n);
+      while (parent[root]!=root) root=parent[root];
+      while (parent[n]!=root) { const int64_t next(parent[n]); parent[n]=root; n=next; }
+      return root;
+    }
+    int64_t join(int64_t a, int64_t b) {
+      a=find(a); b=find(b);
+      if (a==b) return a;
+      if (rank[a]<rank[b]) std::swap(a,b);
+      parent[b]=a;
+      if (rank[a]==rank[b]) rank[a]++;
+      return a;
+    }
+    // finalLabel[n] is the final label of provisional label n; returns the number of sets
+    int64_t resolve(std::vector<int64_t>& finalLabel) {
+      std::vector<int64_t> ofRoot(parent.size(),0);
+      finalLabel.assign(parent.size(),0);
+      int64_t nsets(0);
+      for (int64_t n=1; n<(int64_t)parent.size(); n++) {
+	int64_t& label(ofRoot[find(n)]);
+	if (label==0) label=++nsets;
+	finalLabel[n]=label;
+      }
+      return nsets;
+    }
+  private:
+    std::vector<int64_t> parent;
+    std::vector<int> rank;
+  };
+
+  // Union-find over the labels 1..N that threads may join concurrently. A
+  // join links the larger root under the smaller with a compare-and-swap, so
+  // every set is rooted at its smallest label whatever order the joins take.
+  class sharedLabelForest {
+  public:
+    sharedLabelForest(int64_t nlabels) : parent(nlabels+1)
+      { for (int64_t n=0; n<=nlabels; n++) parent[n].store(n); }
+    int64_t find(int64_t n) {
+      while (true) {
+	int64_t p(parent[n].load());
+	if (p==n) return n;
+	const int64_t grandparent(parent[p].load());
+	if (grandparent!=p) parent[n].compare_exchange_weak(p,grandparent);  // path halving
+	n=grandparent;
+      }
+    }
+    void join(int64_t a, int64_t b) {
+      while (true) {
+	a=find(a); b=find(b);
+	if (a==b) return;
+	if (a<b) std::swap(a,b);
+	int64_t root(a);
+	if (parent[a].compare_exchange_strong(root,b)) return;
+      }
+    }
+    // as labelForest::resolve(), once all the joins are done
+    int64_t resolve(std::vector<int64_t>& finalLabel) {
+      finalLabel.assign(parent.size(),0);
+      int64_t nsets(0);
+      for (int64_t n=1; n<(int64_t)parent.size(); n++) {
+	const int64_t root(find(n));
+	finalLabel[n] = (root==n) ? ++nsets : finalLabel[root];
+      }
+      return nsets;
+    }
+  private:
+    std::vector<std::atomic<int64_t> > parent;
+  };
+
   ////////////////////////////////////////////////////////////////////////////
   struct offset {
     int64_t x,y,z;
@@ -1922,30 +2164,380 @@ volume<T> efficient_convolve(const volume<T>& vin, const volume<S>& vker)
 
   std::vector<offset> backConnectivity(int nDirections);
 
+  // The neighbours of backConnectivity(N), in the same order, as compile-time
+  // tables, so that the labelling loops over them unroll and inline for each N
+  template <int N> struct backNeighbours;
+  template <> struct backNeighbours<6> {
+    static constexpr int size=3;
+    static constexpr int x[size]={-1, 0, 0};
+    static constexpr int y[size]={ 0,-1, 0};
+    static constexpr int z[size]={ 0, 0,-1};
+  };
+  template <> struct backNeighbours<18> {
+    static constexpr int size=9;
+    static constexpr int x[size]={-1, 0, 0,-1,-1, 0, 0, 1, 1};
+    static constexpr int y[size]={ 0,-1, 0,-1, 0, 1,-1,-1, 0};
+    static constexpr int z[size]={ 0, 0,-1, 0,-1,-1,-1, 0,-1};
+  };
+  template <> struct backNeighbours<26> {
+    static constexpr int size=13;
+    static constexpr int x[size]={-1, 0, 0,-1,-1, 0, 0, 1, 1,-1,-1, 1, 1};
+    static constexpr int y[size]={ 0,-1, 0,-1, 0, 1,-1,-1, 0, 1,-1, 1,-1};
+    static constexpr int z[size]={ 0, 0,-1, 0,-1,-1,-1, 0,-1,-1,-1,-1,-1};
+  };
+
+  // Calls f(std::integral_constant<int,k>()) for each neighbour k of
+  // backNeighbours<N> in turn, as a fold rather than a loop
+  template <int N, class F, int... K>
+  inline void for_each_neighbour(F&& f, std::integer_sequence<int,K...>)
+    { (f(std::integral_constant<int,K>()),...); }
+  template <int N, class F>
+  inline void for_each_neighbour(F&& f)
+    { for_each_neighbour<N>(f,std::make_integer_sequence<int,backNeighbours<N>::size>()); }
+
+  // Calls f(std::integral_constant<int,N>()) for the connectivity N of 6, 18
+  // or 26 given at run time: the way in from the labelling functions that
+  // take numconnected to their versions templated on N
+  template <class F>
+  void with_connectivity(int numconnected, F&& f)
+    {
+      switch (numconnected) {
+      case 6:  f(std::integral_constant<int,6>());  break;
+      case 18: f(std::integral_constant<int,18>()); break;
+      case 26: f(std::integral_constant<int,26>()); break;
+      default: imthrow("connectivity must be 6, 18 or 26",3);
+      }
+    }
+
+  // Binary relations of the labelling, between the value of an earlier
+  // neighbour and that of the voxel. sameRoundedValue is the default,
+  // MISCMATHS::round(neighbour)==val made inline; relationPointer calls a
+  // bool (*)(T,T) as the older interface does.
+  struct sameRoundedValue {
+    template <class T>
+    bool operator()(T neighbour, T val) const
+      {
+	if constexpr (std::is_integral<T>::value) return neighbour==val;
+	else return ((neighbour>0.0) ? (int) (neighbour+0.5) : (int) (neighbour-0.5))==val;
+      }
+  };
+
+  template <class T>
+  struct relationPointer {
+    bool (*relation)(T,T);
+    bool operator()(T neighbour, T val) const { return (*relation)(neighbour,val); }
+  };
+
+  // Bounds-checked test of one voxel, for the edges of the image
+  template <class T>
+  bool local_extremum(const volume<T>& vol, const std::vector<offset>& before,
+		      int64_t x, int64_t y, int64_t z, bool minima)
+    {
+      const T val(vol(x,y,z));
+      for (unsigned int k=0; k<before.size(); k++) {
+	const T behind(vol(x+before[k].x,y+before[k].y,z+before[k].z));
+	const T ahead(vol(x-before[k].x,y-before[k].y,z-before[k].z));
+	if ( minima ? !(val<behind && val<=ahead) : !(val>behind && val>=ahead) ) return false;
+      }
+      return true;
+    }
+
+  // Rows away from the edges are compared a whole row at a time against each
+  // neighbour in turn, through linear offsets, in loops the compiler vectorises
+  template <class T>
+  void local_extrema(const volume<T>& vol, const bitmask& candidates, bitmask& peaks,
+		     int numconnected, bool minima)
+    {
+      if (vol.tsize()>1) imthrow("local_extrema: bitmask only holds 3D images",3);
+      const int64_t nx(vol.xsize()), ny(vol.ysize()), nz(vol.zsize());
+      if ( candidates.xsize()!=nx || candidates.ysize()!=ny || candidates.zsize()!=nz )
+	imthrow("local_extrema: candidates must have the size of the image",3);
+      std::vector<offset> before(backConnectivity(numconnected));
+      if (before.empty()) imthrow("local_extrema: connectivity must be 6, 18 or 26",3);
+      std::vector<int64_t> shifts;
+      for (unsigned int k=0; k<before.size(); k++)
+	shifts.push_back(before[k].x + nx*(before[k].y + ny*before[k].z));
+
+      peaks.reinitialize(nx,ny,nz);
+      std::vector<unsigned char> isPeak(nx);
+      const T* data(vol.fbegin());
+      for (int64_t z=0; z<nz; z++) {
+	for (int64_t y=0; y<ny; y++) {
+	  const uint64_t* candidate(candidates.row(y,z));
+	  int64_t w(0);
+	  while (w<candidates.wordsperrow() && candidate[w]==0) w++;
+	  if (w==candidates.wordsperrow()) continue;
+	  if ( y>0 && y<ny-1 && z>0 && z<nz-1 && nx>2 ) {
+	    const T* centre(data+(z*ny+y)*nx);
+	    unsigned char* peak(&isPeak[0]);
+	    std::fill(isPeak.begin(),isPeak.end(),1);
+	    for (unsigned int k=0; k<shifts.size(); k++) {
+	      const T* behind(centre+shifts[k]);
+	      const T* ahead(centre-shifts[k]);
+	      if (minima)
+		for (int64_t x=1; x<nx-1; x++) peak[x] &= (centre[x]<behind[x]) & (centre[x]<=ahead[x]);
+	      else
+		for (int64_t x=1; x<nx-1; x++) peak[x] &= (centre[x]>behind[x]) & (centre[x]>=ahead[x]);
+	    }
+	    isPeak[0]=local_extremum(vol,before,0,y,z,minima);
+	    isPeak[nx-1]=local_extremum(vol,before,nx-1,y,z,minima);
+	  } else {
+	    for (int64_t x=0; x<nx; x++) isPeak[x]=local_extremum(vol,before,x,y,z,minima);
+	  }
+	  uint64_t* row(peaks.row(y,z));
+	  for (int64_t x=0; x<nx; x++) row[x>>6] |= uint64_t(isPeak[x]) << (x&63);
+	  for (w=0; w<peaks.wordsperrow(); w++) row[w] &= candidate[w];
+	}
+      }
+    }
+
+  // The labelling of nonunique_component_labels() and
+  // relabel_components_uniquely() for the z-slab [z0,z1), from the neighbours
+  // within the slab only: one raster scan, joining provisional labels in a
+  // labelForest, leaves them in lab and maps them through slabLabel to the
+  // slab's components, numbered from 1 in order of first occurrence. Voxels
+  // above 0.5 are joined to the earlier neighbours of backNeighbours<N> that
+  // stand in the relation to them; only voxels on the edges check the
+  // neighbours' bounds. ncomponents is -1 if the provisional labels outgrow
+  // the label type L.
+  template <int N, class T, class L, class Relation>
+  void label_slab(const volume<T>& vol, L* lab, int64_t z0, int64_t z1,
+		  std::vector<int64_t>& slabLabel, int64_t& ncomponents, Relation relation)
+    {
+      typedef backNeighbours<N> nb;
+      const int64_t nx(vol.xsize()), ny(vol.ysize());
+      const int64_t maxLabel(std::numeric_limits<L>::max());
+      int64_t shifts[nb::size];
+      for (int k=0; k<nb::size; k++) shifts[k]=nb::x[k] + nx*(nb::y[k] + ny*nb::z[k]);
+      labelForest forest;
+      const T* val(vol.fbegin());
+      for (int64_t z=z0, idx=z0*nx*ny; z<z1; z++) {
+	for (int64_t y=0; y<ny; y++) {
+	  for (int64_t x=0; x<nx; x++, idx++) {
+	    const T v(val[idx]);
+	    if (!(v>0.5)) { lab[idx]=0; continue; }  // The eligibility test
+	    const bool interior( x>0 && x<nx-1 && y>0 && y<ny-1 && z>z0 );
+	    int64_t label(0);
+	    for_each_neighbour<N>([&](auto k) {
+	      constexpr int K(decltype(k)::value);
+	      if ( !interior ) {
+		const int64_t xn(x+nb::x[K]), yn(y+nb::y[K]), zn(z+nb::z[K]);
+		if ( xn<0 || xn>=nx || yn<0 || yn>=ny || zn<z0 ) return;
+	      }
+	      const int64_t n(idx+shifts[K]);
+	      if ( lab[n]==0 || !relation(val[n],v) ) return;  // Binary relation
+	      label = (label==0) ? lab[n] : forest.join(label,lab[n]);
+	    });
+	    if (label==0) {
+	      label=forest.add();
+	      if (label>maxLabel) { ncomponents=-1; return; }
+	    }
+	    lab[idx]=label;
+	  }
+	}
+      }
+      ncomponents=forest.resolve(slabLabel);
+    }
+
+  template <class T, class L, class Relation=sameRoundedValue>
+  void label_slab(const volume<T>& vol, L* lab, int numconnected, int64_t z0, int64_t z1,
+		  std::vector<int64_t>& slabLabel, int64_t& ncomponents, Relation relation=Relation())
+    {
+      with_connectivity(numconnected,[&](auto conn) {
+	  label_slab<decltype(conn)::value>(vol,lab,z0,z1,slabLabel,ncomponents,relation);
+	});
+    }
+
+  // Joins the components of the slab starting at plane z to those of the slab
+  // below, through the neighbours of plane z in plane z-1, in a labelForest or
+  // a sharedLabelForest
+  template <int N, class T, class L, class Forest, class Relation>
+  void join_slabs(const volume<T>& vol, const L* lab, int64_t z,
+		  const std::vector<int64_t>& upperLabel, int64_t upperBase,
+		  const std::vector<int64_t>& lowerLabel, int64_t lowerBase, Forest& forest, Relation relation)
+    {
+      typedef backNeighbours<N> nb;
+      const int64_t nx(vol.xsize()), ny(vol.ysize());
+      const T* val(vol.fbegin());
+      for (int64_t y=0, idx=z*nx*ny; y<ny; y++) {
+	for (int64_t x=0; x<nx; x++, idx++) {
+	  const T v(val[idx]);
+	  if (!(v>0.5)) continue;
+	  for_each_neighbour<N>([&](auto k) {
+	    constexpr int K(decltype(k)::value);
+	    if constexpr (nb::z[K]!=0) {
+	      const int64_t xn(x+nb::x[K]), yn(y+nb::y[K]);
+	      if ( xn<0 || xn>=nx || yn<0 || yn>=ny ) return;
+	      const int64_t n(idx+nb::x[K]+nx*(nb::y[K]-ny));
+	      if ( lab[n]==0 || !relation(val[n],v) ) return;
+	      forest.join(upperBase+upperLabel[lab[idx]],lowerBase+lowerLabel[lab[n]]);
+	    }
+	  });
+	}
+      }
+    }
+
+  template <class T, class L, class Forest, class Relation=sameRoundedValue>
+  void join_slabs(const volume<T>& vol, const L* lab, int numconnected, int64_t z,
+		  const std::vector<int64_t>& upperLabel, int64_t upperBase,
+		  const std::vector<int64_t>& lowerLabel, int64_t lowerBase, Forest& forest,
+		  Relation relation=Relation())
+    {
+      with_connectivity(numconnected,[&](auto conn) {
+	  join_slabs<decltype(conn)::value>(vol,lab,z,upperLabel,upperBase,lowerLabel,lowerBase,forest,relation);
+	});
+    }
+
+  // Final labels for the z-slab [z0,z1), adding its voxels to the statistics
+  // of their components
+  template <class S, class L, class Accumulator>
+  void relabel_slab(const volume<S>& values, L* lab, int64_t z0, int64_t z1,
+		    const std::vector<int64_t>& slabLabel, int64_t base, const std::vector<int64_t>& finalLabel,
+		    int64_t ncomponents, std::vector<Accumulator>& stats)
+    {
+      const int64_t nx(values.xsize()), ny(values.ysize()), nz(values.zsize());
+      std::vector<L> toFinal(slabLabel.size(),0);
+      for (size_t n=1; n<slabLabel.size(); n++) toFinal[n]=finalLabel[base+slabLabel[n]];
+      stats.assign(ncomponents,Accumulator());
+      const S* val(values.fbegin());
+      for (int64_t z=z0, idx=z0*nx*ny; z<z1; z++) {
+	for (int64_t y=0; y<ny; y++) {
+	  for (int64_t x=0; x<nx; x++, idx++) {
+	    if (lab[idx]==0) continue;
+	    lab[idx]=toFinal[lab[idx]];
+	    const bool edge( x==0 || x==nx-1 || y==0 || y==ny-1 || z==0 || z==nz-1 );
+	    stats[lab[idx]-1].add(val[idx],x,y,z,edge);
+	  }
+	}
+      }
+    }
+
+  // Labels nthreads z-slabs at once with label_slab(), numbering the components
+  // of each slab after those of the slabs below. As the slabs are in z order,
+  // the smallest of these labels in any component is still that of its first
+  // voxel in a raster scan of the whole image. The slab boundaries are then
+  // joined concurrently in a sharedLabelForest, and the final relabelling
+  // pass, which also fills stats[label-1] from the voxels of values, is shared
+  // out again by slab: the labels are the same for any number of threads.
+  // The label type L of labelvol must hold the provisional labels of each slab
+  // as well as the final ones; component_label_bound() gives a safe limit.
+  template <int N, class T, class S, class L, class Accumulator, class Relation>
+  void label_components(const volume<T>& vol, const volume<S>& values, volume<L>& labelvol,
+			std::vector<Accumulator>& stats, int nthreads, Relation relation)
+    {
+      const int64_t nz(vol.zsize());
+      if ( values.xsize()!=vol.xsize() || values.ysize()!=vol.ysize() || values.zsize()!=nz )
+	imthrow("label_components: values must have the size of the image",3);
+
+      const int nslabs(std::max((int64_t) 1,std::min((int64_t) nthreads,nz)));
+      std::vector<int64_t> zstart(nslabs+1);
+      for (int s=0; s<=nslabs; s++) zstart[s]=(s*nz)/nslabs;
+      std::vector<std::vector<int64_t> > slabLabel(nslabs);
+      std::vector<int64_t> base(nslabs+1,0);
+      L* lab(labelvol.nsfbegin());
+
+      std::vector<std::thread> threads(nslabs-1); // + main thread makes nslabs
+      for (int s=0; s<nslabs-1; s++)
+	threads[s] = std::thread(label_slab<N,T,L,Relation>,std::cref(vol),lab,zstart[s],zstart[s+1],
+				 std::ref(slabLabel[s]),std::ref(base[s+1]),relation);
+      label_slab<N>(vol,lab,zstart[nslabs-1],nz,slabLabel[nslabs-1],base[nslabs],relation);
+      std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+      for (int s=0; s<nslabs; s++) {
+	if (base[s+1]<0) imthrow("label_components: too many labels for the label type",3);
+	base[s+1]+=base[s];
+      }
+
+      sharedLabelForest forest(base[nslabs]);
+      threads.resize(std::max(nslabs-2,0));
+      for (int s=1; s<nslabs-1; s++)
+	threads[s-1] = std::thread(join_slabs<N,T,L,sharedLabelForest,Relation>,std::cref(vol),lab,zstart[s],
+				   std::cref(slabLabel[s]),base[s],std::cref(slabLabel[s-1]),base[s-1],std::ref(forest),relation);
+      if (nslabs>1)
+	join_slabs<N>(vol,lab,zstart[nslabs-1],slabLabel[nslabs-1],base[nslabs-1],
+		      slabLabel[nslabs-2],base[nslabs-2],forest,relation);
+      std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+      std::vector<int64_t> finalLabel;
+      const int64_t ncomponents(forest.resolve(finalLabel));
+      if (ncomponents>(int64_t) std::numeric_limits<L>::max())
+	imthrow("label_components: too many labels for the label type",3);
+      std::vector<std::vector<Accumulator> > slabStats(nslabs-1);  // stats takes the first slab's
+      threads.resize(nslabs-1);
+      for (int s=1; s<nslabs; s++)
+	threads[s-1] = std::thread(relabel_slab<S,L,Accumulator>,std::cref(values),lab,zstart[s],zstart[s+1],std::cref(slabLabel[s]),
+				   base[s],std::cref(finalLabel),ncomponents,std::ref(slabStats[s-1]));
+      relabel_slab(values,lab,zstart[0],zstart[1],slabLabel[0],base[0],finalLabel,ncomponents,stats);
+      std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+      for (int s=0; s<nslabs-1; s++)
+	for (int64_t n=0; n<ncomponents; n++) stats[n].merge(slabStats[s][n]);
+    }
+
+  template <class T, class S, class L, class Accumulator, class Relation=sameRoundedValue>
+  void label_components(const volume<T>& vol, const volume<S>& values, volume<L>& labelvol,
+			std::vector<Accumulator>& stats, int numconnected, int nthreads=1,
+			Relation relation=Relation())
+    {
+      with_connectivity(numconnected,[&](auto conn) {
+	  label_components<decltype(conn)::value>(vol,values,labelvol,stats,nthreads,relation);
+	});
+    }
+
+  template <class T, class L, class Accumulator>
+  void label_components(const volume<T>& vol, volume<L>& labelvol,
+			std::vector<Accumulator>& stats, int numconnected, int nthreads=1)
+    {
+      label_components(vol,vol,labelvol,stats,numconnected,nthreads);
+    }
+
+  template <class T, class L>
+  void label_components(const volume<T>& vol, volume<L>& labelvol,
+			NEWMAT::ColumnVector& clustersize, int numconnected, int nthreads=1)
+    {
+      std::vector<componentSize> sizes;
+      label_components(vol,labelvol,sizes,numconnected,nthreads);
+      clustersize.ReSize(sizes.size());
+      for (size_t n=0; n<sizes.size(); n++) clustersize(n+1)=sizes[n].size;
+    }
+
+  // The number of voxels that pass the eligibility test, which no label of
+  // label_components() can exceed: labels fit in volume<short> up to 32767
   template <class T>
+  int64_t component_label_bound(const volume<T>& vol)
+    {
+      int64_t count(0);
+      const T* val(vol.fbegin());
+      for (int64_t idx=0; idx<vol.nvoxels(); idx++) count+=(val[idx]>0.5);
+      return count;
+    }
+
+  // Provisional labels and their equivalences for relabel_components_uniquely(),
+  // joining each voxel above 0.5 to the earlier neighbours of backNeighbours<N>
+  // that stand in the relation to it
+  template <int N, class T, class Relation>
   void nonunique_component_labels(const volume<T>& vol,
 				  volume<int>& labelvol,
 				  std::vector<int>& equivlista,
 				  std::vector<int>& equivlistb,
-				  int numconnected)
+				  Relation relation)
     {
+      typedef backNeighbours<N> nb;
       copyconvert(vol,labelvol);
       labelvol = 0;
 
       int labelnum(0);
       equivlista.erase(equivlista.begin(),equivlista.end());
       equivlistb.erase(equivlistb.begin(),equivlistb.end());
-      std::vector<offset> neighbours(backConnectivity(numconnected));
       for (int z=vol.minz(); z<=vol.maxz(); z++)
 	for (int y=vol.miny(); y<=vol.maxy(); y++)
 	  for (int x=vol.minx(); x<=vol.maxx(); x++) {
 	    T val(vol(x,y,z));
 	    if (val>0.5) {  // The eligibility test
 	      int lval(labelvol(x,y,z));
-	      for (std::vector<offset>::iterator it=neighbours.begin();it!=neighbours.end();it++) {
-		int xnew(x+it->x),ynew(y+it->y),znew(z+it->z);
+	      for_each_neighbour<N>([&](auto k) {
+		constexpr int K(decltype(k)::value);
+		int xnew(x+nb::x[K]),ynew(y+nb::y[K]),znew(z+nb::z[K]);
 		if ( (xnew>=vol.minx()) && (ynew>=vol.miny()) && (znew>=vol.minz())
- 		     && (MISCMATHS::round(vol(xnew,ynew,znew)))==val) {
+		     && relation(vol(xnew,ynew,znew),val)) {
 		  // Binary relation
 		  int lval2 = labelvol(xnew,ynew,znew);
 		  if (lval != lval2) {
@@ -1955,7 +2547,7 @@ volume<T> efficient_convolve(const volume<T>& vin, const volume<S>& vker)
 		    lval = lval2;
 		  }
 		}
-	      }
+	      });
 	      if (lval==0)
 		labelvol(x,y,z) = ++labelnum;
 	    }
@@ -1967,54 +2559,44 @@ volume<T> efficient_convolve(const volume<T>& vin, const volume<S>& vker)
 				  volume<int>& labelvol,
 				  std::vector<int>& equivlista,
 				  std::vector<int>& equivlistb,
-				  bool (*binaryrelation)(T , T),
 				  int numconnected)
     {
-      copyconvert(vol,labelvol);
-      labelvol = 0;
+      with_connectivity(numconnected,[&](auto conn) {
+	  nonunique_component_labels<decltype(conn)::value>(vol,labelvol,equivlista,equivlistb,
+							    sameRoundedValue());
+	});
+    }
 
-      int labelnum(0);
-      equivlista.erase(equivlista.begin(),equivlista.end());
-      equivlistb.erase(equivlistb.begin(),equivlistb.end());
-      std::vector<offset> neighbours(backConnectivity(numconnected));
-      for (int z=vol.minz(); z<=vol.maxz(); z++)
-	for (int y=vol.miny(); y<=vol.maxy(); y++)
-	  for (int x=vol.minx(); x<=vol.maxx(); x++) {
-	    T val(vol(x,y,z));
-	    if (val>0.5) {  // The eligibility test
-	      int lval(labelvol(x,y,z));
-	      for (std::vector<offset>::iterator it=neighbours.begin();it!=neighbours.end();it++) {
-		int xnew(x+it->x),ynew(y+it->y),znew(z+it->z);
-		if ((xnew>=vol.minx()) && (ynew>=vol.miny()) && (znew>=vol.minz())
-		     && ((*binaryrelation)(vol(xnew,ynew,znew),val))) {
-		  // Binary relation
-		  int lval2 = labelvol(xnew,ynew,znew);
-		  if (lval != lval2) {
-		    if (lval!=0)
-		      addpair2set(lval2,lval,equivlista,equivlistb);
-		    labelvol(x,y,z) = lval2;
-		    lval = lval2;
-		  }
-		}
-	      }
-	      if (lval==0)
-		labelvol(x,y,z) = ++labelnum;
-	    }
-	  }
+  template <class T>
+  void nonunique_component_labels(const volume<T>& vol,
+				  volume<int>& labelvol,
+				  std::vector<int>& equivlista,
+				  std::vector<int>& equivlistb,
+				  bool (*binaryrelation)(T , T),
+				  int numconnected)
+    {
+      with_connectivity(numconnected,[&](auto conn) {
+	  nonunique_component_labels<decltype(conn)::value>(vol,labelvol,equivlista,equivlistb,
+							    relationPointer<T>{binaryrelation});
+	});
     }
 
   template <class T>
-  volume<int> connected_components(const volume<T>& vol, NEWMAT::ColumnVector& clustersize, int numconnected)
+  volume<int> connected_components(const volume<T>& vol, NEWMAT::ColumnVector& clustersize, int numconnected, int nthreads)
     {
       volume<int> labelvol;
-      copyconvert(vol,labelvol);
-      std::vector<int> equivlista, equivlistb;
-      nonunique_component_labels(vol,labelvol,
-				 equivlista,equivlistb,numconnected);
-      relabel_components_uniquely(labelvol,equivlista,equivlistb,clustersize);
+      connected_components(vol,labelvol,clustersize,numconnected,nthreads);
       return labelvol;
     }
 
+  template <class T, class L>
+  void connected_components(const volume<T>& vol, volume<L>& labelvol,
+			    NEWMAT::ColumnVector& clustersize, int numconnected, int nthreads)
+    {
+      copyconvert(vol,labelvol,false);
+      label_components(vol,labelvol,clustersize,numconnected,nthreads);
+    }
+
 
   template <class T>
   volume<int> connected_components(const volume<T>& vol,
@@ -2032,9 +2614,9 @@ volume<T> efficient_convolve(const volume<T>& vin, const volume<S>& vker)
 
 
   template <class T>
-  volume<int> connected_components(const volume<T>& vol, int numconnected){
+  volume<int> connected_components(const volume<T>& vol, int numconnected, int nthreads){
     NEWMAT::ColumnVector clustersize;
-    return connected_components(vol,clustersize,numconnected);
+    return connected_components(vol,clustersize,numconnected,nthreads);
   }
 
 
@@ -103,6 +103,53 @@ int read_volume4D_hdr_only(volume<T>& target, const std::string& filename) {
   return read_volume_hdr_only(target,filename);
 }
 
+// Reads the 3D volumes of an image one at a time, in file order, through a
+// single open file: only one volume is held in memory and compressed files
+// are decompressed once, so very long 4D stacks can be processed in turn.
+// read_next_slab() reads a volume a few z-planes at a time instead, each
+// slab with its header offset to its first plane; read_next_volume() reads
+// the rest of the current volume.
+class volumeStream {
+ public:
+  volumeStream(const std::string& filename);
+  int64_t nvolumes() const { return nvols; }
+  int64_t volumesRead() const { return nread; }
+  template <class T>
+  bool read_next_volume(volume<T>& target);
+  template <class T>
+  bool read_next_slab(volume<T>& target, const int64_t nslices);
+ private:
+  volumeStream(const volumeStream&);
+  volumeStream& operator=(const volumeStream&);
+  std::string name;
+  NiftiIO::NiftiHeader header;
+  NiftiIO::fileIO reader;
+  int64_t nvols, nread;
+  int64_t slicesRead;  // of the current volume
+};
+
+// Writes an image a few z-planes at a time, in file order, through a single
+// open file, so that it is never held in memory whole. The header is the one
+// save_volume() would write for geometry, whose data are not used: a volume
+// from read_volume_hdr_only() will do. Slabs are given in the same
+// (radiological) order as read_next_slab() returns them.
+class slabWriter {
+ public:
+  template <class T>
+  slabWriter(const volume<T>& geometry, const std::string& filename, const int filetype=-1);
+  int64_t slicesWritten() const { return nwritten; }
+  template <class T>
+  void write_next_slab(const volume<T>& slab);
+ private:
+  slabWriter(const slabWriter&);
+  slabWriter& operator=(const slabWriter&);
+  int outputType;
+  std::string name;
+  NiftiIO::NiftiHeader header;
+  NiftiIO::fileIO writer;
+  int64_t nwritten;
+};
+
 
   // save
 
@@ -0,0 +1,92 @@
+#define EXPOSE_TREACHEROUS
+
+#include "newimage/newimageall.h"
+#include "armawrap/newmat.h"
+#include <stdlib.h>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_bitmask)
+
+
+using namespace NEWIMAGE;
+using namespace NEWMAT;
+using namespace std;
+
+
+// Random image whose rows are not a multiple of 64 voxels long,
+// so that the last word of every row is only partly used
+volume<float> random_volume(int nx, int ny, int nz, int seed)
+{
+  volume<float> vol(nx, ny, nz);
+  srand(seed);
+  for (int z = 0; z < nz; z++) {
+  for (int y = 0; y < ny; y++) {
+  for (int x = 0; x < nx; x++) {
+    vol(x, y, z) = (rand() % 1000) / 100.0;
+  }}}
+  return vol;
+}
+
+
+BOOST_AUTO_TEST_CASE(binarise_matches_volume_binarise)
+{
+  volume<float> vol = random_volume(70, 9, 7, 1);
+  threshtype types[] = {inclusive, exclusive};
+
+  for (int t = 0; t < 2; t++) {
+  for (int invert = 0; invert < 2; invert++) {
+    volume<float> bin = binarise(vol, 2.5f, 7.0f, types[t], invert);
+    bitmask mask;
+    binarise(vol, mask, 2.5f, 7.0f, types[t], invert);
+
+    BOOST_CHECK(mask.xsize() == 70);
+    BOOST_CHECK(mask.wordsperrow() == 2);
+    BOOST_CHECK(mask.count() == bin.sum());
+    for (int z = 0; z < vol.zsize(); z++) {
+    for (int y = 0; y < vol.ysize(); y++) {
+    for (int x = 0; x < vol.xsize(); x++) {
+      BOOST_CHECK(mask(x, y, z) == (bin(x, y, z) > 0.5));
+    }}}
+  }}
+}
+
+
+// Labels (numbered by first raster occurrence) and cluster
+// sizes must match those from the volume version
+BOOST_AUTO_TEST_CASE(connected_components_matches_volume)
+{
+  volume<float> vol = random_volume(67, 13, 11, 2);
+  int connectivity[] = {6, 18, 26};
+
+  for (int c = 0; c < 3; c++) {
+    volume<float> bin = binarise(vol, 6.0f, vol.max(), inclusive);
+    ColumnVector sizes, bitsizes;
+    volume<int> labels = connected_components(bin, sizes, connectivity[c]);
+
+    bitmask mask;
+    binarise(vol, mask, 6.0f, vol.max(), inclusive);
+    volume<int> bitlabels;
+    connected_components(mask, bitlabels, bitsizes, connectivity[c]);
+
+    BOOST_CHECK(sizes.Nrows() == bitsizes.Nrows());
+    for (int n = 1; n <= sizes.Nrows() && n <= bitsizes.Nrows(); n++) {
+      BOOST_CHECK(sizes(n) == bitsizes(n));
+    }
+    for (int z = 0; z < vol.zsize(); z++) {
+    for (int y = 0; y < vol.ysize(); y++) {
+    for (int x = 0; x < vol.xsize(); x++) {
+      BOOST_CHECK(labels(x, y, z) == bitlabels(x, y, z));
+    }}}
+  }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,279 @@
+#define EXPOSE_TREACHEROUS
+
+#include "newimage/newimageall.h"
+#include "armawrap/newmat.h"
+#include <stdlib.h>
+#include <vector>
+#include <deque>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_connected_components)
+
+
+using namespace NEWIMAGE;
+using namespace NEWMAT;
+using namespace std;
+
+
+// Reference labelling by flood fill: voxels above 0.5 joined to
+// neighbours of the same value, components numbered in order
+// of their first voxel in a raster scan
+volume<int> flood_fill_labels(const volume<float>& vol, int numconnected, vector<int>& sizes)
+{
+  volume<int> labels(vol.xsize(), vol.ysize(), vol.zsize());
+  labels = 0;
+  sizes.clear();
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    if (vol(x, y, z) <= 0.5 || labels(x, y, z) != 0) { continue; }
+    int label = sizes.size() + 1;
+    sizes.push_back(0);
+    deque<offset> todo(1, offset(x, y, z));
+    labels(x, y, z) = label;
+    while (!todo.empty()) {
+      offset v = todo.front();
+      todo.pop_front();
+      sizes.back()++;
+      for (int dz = -1; dz <= 1; dz++) {
+      for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        int dist = abs(dx) + abs(dy) + abs(dz);
+        if (dist == 0 || (numconnected == 6 && dist > 1) || (numconnected == 18 && dist > 2)) { continue; }
+        int nx = v.x + dx, ny = v.y + dy, nz = v.z + dz;
+        if (nx < 0 || ny < 0 || nz < 0 || nx >= vol.xsize() || ny >= vol.ysize() || nz >= vol.zsize()) { continue; }
+        if (labels(nx, ny, nz) != 0 || vol(nx, ny, nz) != vol(v.x, v.y, v.z)) { continue; }
+        labels(nx, ny, nz) = label;
+        todo.push_back(offset(nx, ny, nz));
+      }}}
+    }
+  }}}
+  return labels;
+}
+
+
+// Several integer values, so that touching components of
+// different values must stay apart
+BOOST_AUTO_TEST_CASE(labels_match_flood_fill)
+{
+  volume<float> vol(23, 17, 11);
+  srand(5);
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    vol(x, y, z) = rand() % 4;
+  }}}
+
+  int connectivity[] = {6, 18, 26};
+  for (int c = 0; c < 3; c++) {
+    vector<int> refsizes;
+    volume<int> reference = flood_fill_labels(vol, connectivity[c], refsizes);
+    ColumnVector sizes;
+    volume<int> labels = connected_components(vol, sizes, connectivity[c]);
+
+    BOOST_CHECK(sizes.Nrows() == (int)refsizes.size());
+    for (unsigned int n = 0; n < refsizes.size(); n++) {
+      BOOST_CHECK(sizes(n + 1) == refsizes[n]);
+    }
+    for (int z = 0; z < vol.zsize(); z++) {
+    for (int y = 0; y < vol.ysize(); y++) {
+    for (int x = 0; x < vol.xsize(); x++) {
+      BOOST_CHECK(labels(x, y, z) == reference(x, y, z));
+    }}}
+  }
+}
+
+
+// Components running through several z-slabs, which must be
+// joined across the slab boundaries into the serial labels
+BOOST_AUTO_TEST_CASE(threaded_labels_match_serial)
+{
+  volume<float> vol(19, 13, 29);
+  srand(7);
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    vol(x, y, z) = (rand() % 3 != 0) ? 1 + rand() % 2 : 0;
+  }}}
+
+  int connectivity[] = {6, 18, 26};
+  int nthreads[] = {2, 3, 8, 29, 40};
+  for (int c = 0; c < 3; c++) {
+    ColumnVector serialsizes;
+    volume<int> serial = connected_components(vol, serialsizes, connectivity[c]);
+    for (int t = 0; t < 5; t++) {
+      ColumnVector sizes;
+      volume<int> labels = connected_components(vol, sizes, connectivity[c], nthreads[t]);
+      BOOST_CHECK(sizes.Nrows() == serialsizes.Nrows());
+      for (int n = 1; n <= serialsizes.Nrows(); n++) {
+        BOOST_CHECK(sizes(n) == serialsizes(n));
+      }
+      for (int z = 0; z < vol.zsize(); z++) {
+      for (int y = 0; y < vol.ysize(); y++) {
+      for (int x = 0; x < vol.xsize(); x++) {
+        BOOST_CHECK(labels(x, y, z) == serial(x, y, z));
+      }}}
+    }
+  }
+}
+
+
+// Statistics gathered while labelling must equal those of a
+// second pass over the labels, whatever the number of slabs
+BOOST_AUTO_TEST_CASE(accumulators_match_second_pass)
+{
+  volume<float> vol(15, 12, 10), values(15, 12, 10);
+  srand(11);
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    vol(x, y, z) = (rand() % 4 == 0) ? 0 : 1;
+    values(x, y, z) = rand() % 9 + 1;
+  }}}
+  // a component clear of the edges
+  for (int z = 2; z < 8; z++) {
+  for (int y = 2; y < 10; y++) {
+  for (int x = 2; x < 13; x++) {
+    vol(x, y, z) = (x == 2 || x == 12 || y == 2 || y == 9 || z == 2 || z == 7) ? 0 : 2;
+  }}}
+
+  typedef componentStats<componentSize, componentSum, componentMax<float>,
+                         componentBounds, componentCentroid, componentEdge> allStats;
+  int nthreads[] = {1, 2, 4};
+  for (int t = 0; t < 3; t++) {
+    volume<int> labels;
+    copyconvert(vol, labels, false);
+    vector<allStats> stats;
+    label_components(vol, values, labels, stats, 6, nthreads[t]);
+    BOOST_CHECK(stats.size() == (unsigned int)labels.max());
+
+    vector<allStats> reference(stats.size());
+    for (int z = 0; z < vol.zsize(); z++) {
+    for (int y = 0; y < vol.ysize(); y++) {
+    for (int x = 0; x < vol.xsize(); x++) {
+      if (labels(x, y, z) == 0) { continue; }
+      bool edge = x == 0 || y == 0 || z == 0 || x == vol.maxx() || y == vol.maxy() || z == vol.maxz();
+      reference[labels(x, y, z) - 1].add(values(x, y, z), x, y, z, edge);
+    }}}
+
+    int interior = 0;
+    for (unsigned int n = 0; n < stats.size(); n++) {
+      BOOST_CHECK(stats[n].size == reference[n].size);
+      BOOST_CHECK(stats[n].sum == reference[n].sum);
+      BOOST_CHECK(stats[n].max == reference[n].max);
+      BOOST_CHECK(stats[n].touchesEdge == reference[n].touchesEdge);
+      interior += !stats[n].touchesEdge;
+      for (int d = 0; d < 3; d++) {
+        BOOST_CHECK(stats[n].at[d] == reference[n].at[d]);
+        BOOST_CHECK(stats[n].lower[d] == reference[n].lower[d]);
+        BOOST_CHECK(stats[n].upper[d] == reference[n].upper[d]);
+        BOOST_CHECK_CLOSE(stats[n].cog(d), reference[n].cog(d), 1e-9);
+      }
+    }
+    BOOST_CHECK(interior > 0);
+  }
+}
+
+
+// Compact label types give the same labels, and refuse
+// images with more components than they can hold
+BOOST_AUTO_TEST_CASE(compact_label_types)
+{
+  volume<float> vol(21, 14, 12);
+  srand(13);
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    vol(x, y, z) = rand() % 3;
+  }}}
+  BOOST_CHECK(component_label_bound(vol) <= 32767);
+
+  ColumnVector intsizes, shortsizes;
+  volume<int> intlabels = connected_components(vol, intsizes, 26);
+  volume<short> shortlabels;
+  connected_components(vol, shortlabels, shortsizes, 26, 3);
+  BOOST_CHECK(shortsizes.Nrows() == intsizes.Nrows());
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    BOOST_CHECK(shortlabels(x, y, z) == intlabels(x, y, z));
+  }}}
+
+  // isolated voxels under 6-connectivity, far more than a char holds
+  volume<float> checks(10, 10, 10);
+  for (int z = 0; z < 10; z++) {
+  for (int y = 0; y < 10; y++) {
+  for (int x = 0; x < 10; x++) {
+    checks(x, y, z) = (x + y + z) % 2;
+  }}}
+  volume<char> charlabels;
+  ColumnVector charsizes;
+  BOOST_CHECK_THROW(connected_components(checks, charlabels, charsizes, 6), std::exception);
+  BOOST_CHECK_THROW(connected_components(checks, charlabels, charsizes, 6, 8), std::exception);
+}
+
+
+bool same_rounded(float neighbour, float val) { return MISCMATHS::round(neighbour) == val; }
+
+struct bothEligible {
+  bool operator()(float neighbour, float val) const { return neighbour > 0.5 && val > 0.5; }
+};
+
+
+// The relation given as a function pointer or as a functor must
+// label as the default relation does when it means the same,
+// and a relation joining all eligible voxels must give the
+// components of the binarised image
+BOOST_AUTO_TEST_CASE(relations)
+{
+  volume<float> vol(17, 12, 9);
+  srand(19);
+  for (int z = 0; z < vol.zsize(); z++) {
+  for (int y = 0; y < vol.ysize(); y++) {
+  for (int x = 0; x < vol.xsize(); x++) {
+    vol(x, y, z) = rand() % 4;
+  }}}
+  volume<float> binary(vol);
+  binary.binarise(0.5, binary.max() + 1, exclusive);
+
+  int connectivity[] = {6, 18, 26};
+  for (int c = 0; c < 3; c++) {
+    vector<int> lista, listb, pointera, pointerb;
+    volume<int> labels, pointerlabels;
+    nonunique_component_labels(vol, labels, lista, listb, connectivity[c]);
+    nonunique_component_labels(vol, pointerlabels, pointera, pointerb, &same_rounded, connectivity[c]);
+    BOOST_CHECK(pointera == lista);
+    BOOST_CHECK(pointerb == listb);
+
+    volume<int> serial, threaded, merged;
+    copyconvert(vol, threaded, false);
+    copyconvert(vol, merged, false);
+    vector<componentSize> sizes, mergedsizes;
+    label_components(vol, vol, threaded, sizes, connectivity[c], 3, sameRoundedValue());
+    label_components(vol, vol, merged, mergedsizes, connectivity[c], 3, bothEligible());
+    serial = connected_components(vol, connectivity[c]);
+    volume<int> binarylabels = connected_components(binary, connectivity[c]);
+    for (int z = 0; z < vol.zsize(); z++) {
+    for (int y = 0; y < vol.ysize(); y++) {
+    for (int x = 0; x < vol.xsize(); x++) {
+      BOOST_CHECK(pointerlabels(x, y, z) == labels(x, y, z));
+      BOOST_CHECK(threaded(x, y, z) == serial(x, y, z));
+      BOOST_CHECK(merged(x, y, z) == binarylabels(x, y, z));
+    }}}
+    BOOST_CHECK(mergedsizes.size() < sizes.size());
+  }
+
+  vector<int> lista, listb;
+  volume<int> labels;
+  BOOST_CHECK_THROW(nonunique_component_labels(vol, labels, lista, listb, 8), std::exception);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,106 @@
+#define EXPOSE_TREACHEROUS
+
+#include "newimage/newimageall.h"
+#include "armawrap/newmat.h"
+#include <stdlib.h>
+#include <set>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_fill_holes)
+
+
+using namespace NEWIMAGE;
+using namespace NEWMAT;
+using namespace std;
+
+
+// Reference by labelling the background: its components
+// that touch no edge of the image are holes
+volume<float> labelled_fill(const volume<float>& im, int connectivity)
+{
+  volume<float> background(im);
+  background.binarise(0, 0, inclusive, false);
+  volume<int> labels = connected_components(background, connectivity);
+  set<int> edgelabs;
+  for (int z = 0; z < im.zsize(); z++) {
+  for (int y = 0; y < im.ysize(); y++) {
+  for (int x = 0; x < im.xsize(); x++) {
+    if (x == 0 || y == 0 || z == 0 || x == im.maxx() || y == im.maxy() || z == im.maxz()) {
+      edgelabs.insert(labels(x, y, z));
+    }
+  }}}
+  volume<float> filled(im);
+  for (int z = 0; z < im.zsize(); z++) {
+  for (int y = 0; y < im.ysize(); y++) {
+  for (int x = 0; x < im.xsize(); x++) {
+    if (labels(x, y, z) > 0 && edgelabs.count(labels(x, y, z)) == 0) { filled(x, y, z) = 1; }
+  }}}
+  return filled;
+}
+
+
+// A hollow box is filled unless its wall has a gap, which
+// lets the outside in only through the connectivities that
+// cross it
+BOOST_AUTO_TEST_CASE(hollow_box)
+{
+  volume<float> box(9, 8, 7);
+  box = 0;
+  for (int z = 1; z < 6; z++) {
+  for (int y = 1; y < 7; y++) {
+  for (int x = 1; x < 8; x++) {
+    box(x, y, z) = (x == 1 || x == 7 || y == 1 || y == 6 || z == 1 || z == 5) ? 3 : 0;
+  }}}
+
+  int connectivity[] = {6, 18, 26};
+  for (int c = 0; c < 3; c++) {
+    volume<float> filled = fill_holes(box, connectivity[c]);
+    BOOST_CHECK(filled(4, 3, 3) == 1);
+    BOOST_CHECK(filled(1, 1, 1) == 3);
+    BOOST_CHECK(filled(0, 0, 0) == 0);
+  }
+
+  // a gap in an edge of the wall, which the inside voxel (2,2,3)
+  // only touches diagonally
+  box(1, 1, 3) = 0;
+  BOOST_CHECK(fill_holes(box, 6)(4, 3, 3) == 1);
+  BOOST_CHECK(fill_holes(box, 18)(4, 3, 3) == 0);
+  BOOST_CHECK(fill_holes(box, 26)(4, 3, 3) == 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(fill_matches_labelling)
+{
+  srand(17);
+  int connectivity[] = {6, 18, 26};
+  int holes = 0;
+  for (int n = 0; n < 10; n++) {
+    volume<float> im(14 + n, 11, 9);
+    for (int z = 0; z < im.zsize(); z++) {
+    for (int y = 0; y < im.ysize(); y++) {
+    for (int x = 0; x < im.xsize(); x++) {
+      im(x, y, z) = (rand() % 100 < 45 + 3 * n) ? 1 + rand() % 3 : 0;
+    }}}
+    for (int c = 0; c < 3; c++) {
+      volume<float> filled = fill_holes(im, connectivity[c]);
+      volume<float> reference = labelled_fill(im, connectivity[c]);
+      for (int z = 0; z < im.zsize(); z++) {
+      for (int y = 0; y < im.ysize(); y++) {
+      for (int x = 0; x < im.xsize(); x++) {
+        BOOST_CHECK(filled(x, y, z) == reference(x, y, z));
+        holes += (filled(x, y, z) != im(x, y, z));
+      }}}
+    }
+  }
+  BOOST_CHECK(holes > 0);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+#define EXPOSE_TREACHEROUS
+
+#include "newimage/newimageall.h"
+#include <stdlib.h>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_local_extrema)
+
+
+using namespace NEWIMAGE;
+using namespace std;
+
+
+// Reference test of one voxel: strictly above (below) the
+// neighbours before it in raster order, at least equal to the
+// ones after, with zeros beyond the edge of the image
+bool is_extremum(const volume<int>& vol, int x, int y, int z, int numconnected, bool minima)
+{
+  int val = vol(x, y, z);
+  for (int dz = -1; dz <= 1; dz++) {
+  for (int dy = -1; dy <= 1; dy++) {
+  for (int dx = -1; dx <= 1; dx++) {
+    int dist = abs(dx) + abs(dy) + abs(dz);
+    if (dist == 0 || (numconnected == 6 && dist > 1) || (numconnected == 18 && dist > 2)) { continue; }
+    int nx = x + dx, ny = y + dy, nz = z + dz;
+    int nb = 0;
+    if (nx >= 0 && ny >= 0 && nz >= 0 && nx < vol.xsize() && ny < vol.ysize() && nz < vol.zsize()) {
+      nb = vol(nx, ny, nz);
+    }
+    bool before = (dz < 0) || (dz == 0 && dy < 0) || (dz == 0 && dy == 0 && dx < 0);
+    if (minima) { nb = -nb; val = -val; }
+    bool ok = before ? (val > nb) : (val >= nb);
+    if (minima) { nb = -nb; val = -val; }
+    if (!ok) { return false; }
+  }}}
+  return true;
+}
+
+
+// Few distinct values, so that plateaus and ties are common, in an
+// image whose rows do not fill whole words and whose edges hold peaks
+BOOST_AUTO_TEST_CASE(local_extrema_matches_reference)
+{
+  const int nx = 70, ny = 6, nz = 5;
+  volume<int> vol(nx, ny, nz);
+  vol.setextrapolationmethod(zeropad);
+  srand(3);
+  for (int z = 0; z < nz; z++) {
+  for (int y = 0; y < ny; y++) {
+  for (int x = 0; x < nx; x++) {
+    vol(x, y, z) = rand() % 4 - 1;
+  }}}
+
+  bitmask candidates(nx, ny, nz);
+  for (int z = 0; z < nz; z++) {
+  for (int y = 0; y < ny; y++) {
+  for (int x = 0; x < nx; x++) {
+    if ((x + 2 * y + 3 * z) % 5 != 0) { candidates.set(x, y, z); }
+  }}}
+
+  int connectivities[] = {6, 18, 26};
+  for (int c = 0; c < 3; c++) {
+  for (int minima = 0; minima < 2; minima++) {
+    bitmask peaks;
+    local_extrema(vol, candidates, peaks, connectivities[c], minima);
+    int npeaks = 0;
+    for (int z = 0; z < nz; z++) {
+    for (int y = 0; y < ny; y++) {
+    for (int x = 0; x < nx; x++) {
+      bool expected = candidates(x, y, z) && is_extremum(vol, x, y, z, connectivities[c], minima);
+      BOOST_CHECK(peaks(x, y, z) == expected);
+      npeaks += expected;
+    }}}
+    BOOST_CHECK(npeaks > 0);
+    BOOST_CHECK(peaks.count() == npeaks);
+  }}
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
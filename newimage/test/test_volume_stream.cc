@@ -0,0 +1,142 @@
+#define EXPOSE_TREACHEROUS
+
+#include "newimage/newimageall.h"
+#include "armawrap/newmat.h"
+#include <stdlib.h>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_volume_stream)
+
+
+using namespace NEWIMAGE;
+using namespace NEWMAT;
+using namespace std;
+
+
+// A 4D image streamed one volume at a time must give the
+// same volumes as reading the whole image, for single file
+// and paired, compressed and uncompressed formats
+BOOST_AUTO_TEST_CASE(stream_matches_read_volume4D)
+{
+  const int nx = 4, ny = 3, nz = 5, nt = 6;
+  vector<short> data(nx * ny * nz * nt);
+  for (size_t i = 0; i < data.size(); i++) { data[i] = (i * 37) % 101 - 50; }
+
+  volume<short> vol;
+  vol.reinitialize(nx, ny, nz, nt, data.data(), false);
+  vol.setdims(2, 2, 2, 1);
+
+  int formats[] = {FSL_TYPE_NIFTI, FSL_TYPE_NIFTI_GZ, FSL_TYPE_NIFTI_PAIR, FSL_TYPE_NIFTI_PAIR_GZ};
+
+  for (int f = 0; f < 4; f++) {
+
+    string name = "stream_test_" + MISCMATHS::num2str(f);
+    save_volume(vol, name, formats[f]);
+
+    volume<float> whole, one;
+    read_volume4D(whole, name);
+
+    volumeStream stream(name);
+    BOOST_CHECK(stream.nvolumes() == nt);
+
+    int t = 0;
+    while (stream.read_next_volume(one)) {
+      BOOST_CHECK(one.xsize() == nx);
+      BOOST_CHECK(one.ysize() == ny);
+      BOOST_CHECK(one.zsize() == nz);
+      BOOST_CHECK(one.tsize() == 1);
+      BOOST_CHECK(one.xdim()  == whole.xdim());
+      for (int z = 0; z < nz; z++) {
+      for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        BOOST_CHECK(one(x, y, z) == whole(x, y, z, t));
+      }}}
+      t++;
+    }
+    BOOST_CHECK(t == nt);
+    BOOST_CHECK(stream.volumesRead() == nt);
+    BOOST_CHECK(!stream.read_next_volume(one));
+  }
+}
+
+
+// Slabs read from a neurological image come in radiological
+// order with their headers offset to their first plane, and
+// written back a slab at a time they rebuild the image
+BOOST_AUTO_TEST_CASE(slabs_round_trip)
+{
+  const int nx = 5, ny = 4, nz = 7;
+  volume<float> vol(nx, ny, nz);
+  for (int z = 0; z < nz; z++) {
+  for (int y = 0; y < ny; y++) {
+  for (int x = 0; x < nx; x++) {
+    vol(x, y, z) = x + 10 * y + 100 * z;
+  }}}
+  vol.setdims(2, 2, 3);
+  Matrix sform(IdentityMatrix(4));
+  sform(1, 1) = 2;  sform(2, 2) = 2;  sform(3, 3) = 3;
+  sform(1, 4) = -4; sform(2, 4) = 5;  sform(3, 4) = 6;
+  vol.set_sform(NiftiIO::NIFTI_XFORM_SCANNER_ANAT, sform);
+  vol.set_qform(NiftiIO::NIFTI_XFORM_SCANNER_ANAT, sform);
+
+  int formats[] = {FSL_TYPE_NIFTI, FSL_TYPE_NIFTI_GZ, FSL_TYPE_NIFTI_PAIR, FSL_TYPE_NIFTI_PAIR_GZ};
+
+  for (int f = 0; f < 4; f++) {
+
+    string name = "slab_test_" + MISCMATHS::num2str(f);
+    string copy = "slab_copy_" + MISCMATHS::num2str(f);
+    save_volume(vol, name, formats[f]);
+    volume<float> whole;
+    read_volume(whole, name);
+
+    volume<float> geometry;
+    read_volume_hdr_only(geometry, name);
+    slabWriter writer(geometry, copy, formats[f]);
+    volumeStream stream(name);
+    volume<float> slab;
+    int z0 = 0;
+    while (stream.read_next_slab(slab, 3)) {
+      BOOST_CHECK(slab.zsize() == min(3, nz - z0));
+      BOOST_CHECK(slab.left_right_order() == whole.left_right_order());
+      ColumnVector origin(4), wholeorigin(4);
+      origin << 0 << 0 << 0 << 1;
+      wholeorigin << 0 << 0 << z0 << 1;
+      BOOST_CHECK(((slab.sform_mat() * origin) - (whole.sform_mat() * wholeorigin)).MaximumAbsoluteValue() < 1e-6);
+      for (int z = 0; z < slab.zsize(); z++) {
+      for (int y = 0; y < ny; y++) {
+      for (int x = 0; x < nx; x++) {
+        BOOST_CHECK(slab(x, y, z) == whole(x, y, z0 + z));
+      }}}
+      writer.write_next_slab(slab);
+      z0 += slab.zsize();
+    }
+    BOOST_CHECK(z0 == nz);
+    BOOST_CHECK(writer.slicesWritten() == nz);
+    BOOST_CHECK(stream.volumesRead() == 1);
+  }
+
+  // the files are only complete once the writers have closed them
+  for (int f = 0; f < 4; f++) {
+    volume<float> whole, copied;
+    read_volume(whole, "slab_test_" + MISCMATHS::num2str(f));
+    read_volume(copied, "slab_copy_" + MISCMATHS::num2str(f));
+    BOOST_CHECK(samesize(whole, copied));
+    BOOST_CHECK((whole.sform_mat() - copied.sform_mat()).MaximumAbsoluteValue() < 1e-6);
+    for (int z = 0; z < nz; z++) {
+    for (int y = 0; y < ny; y++) {
+    for (int x = 0; x < nx; x++) {
+      BOOST_CHECK(copied(x, y, z) == whole(x, y, z));
+    }}}
+  }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,11 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <memory>
 
 #include "utils/options.h"
 #include "miscmaths/miscmaths.h"
@@ -40,6 +45,18 @@ Option<string> zstatname(string("-z,--zstat"), "zstat",
 Option<string> residname(string("-r,--res"), "res4d",
 			 string("filename of `residual-fit' image (use -d)"),
 			 true, requires_argument);
+Option<int> numthreads(string("--nthr"), 1,
+		       string("number of threads, used for the sweeps over the residuals and for the --orpv image (default 1)"),
+		       false, requires_argument);
+Option<string> rpvname(string("--orpv"), string(""),
+		       string("filename of output resels-per-voxel image, from the smoothness within a box around each voxel"),
+		       false, requires_argument);
+Option<int> rpvwindow(string("--rpvwindow"), 4,
+		      string("half-width in voxels of the box for --orpv (default 4)"),
+		      false, requires_argument);
+Option<bool> streaming(string("-s,--stream"), false,
+		       string("read the data a volume at a time, in two passes, rather than all at once"),
+		       false, no_argument);
 
 namespace SMOOTHEST {
 
@@ -91,53 +108,316 @@ Interpolate interpolate;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// Standardise the residual field (assuming gaussianity)
-unsigned long standardise(volume<float>& mask,
-			  volume4D<float>& R)
-{
-  unsigned long count = 0;
-  int M=R.tsize();
-
-  for (int z=mask.minz(); z<=mask.maxz(); z++) {
-    for (int y=mask.miny(); y<=mask.maxy(); y++) {
-      for (int x=mask.minx(); x<=mask.maxx(); x++) {
-
-	if( mask(x,y,z) > 0.5) {
-
-	  count ++;
+// The sums over one z-plane. Threads take whole planes, and the planes' sums
+// are added pairwise in plane order, so that the totals are the same bit for
+// bit whatever the number of threads.
+enum {X = 0, Y, Z};
+
+struct planeSums {
+  double SSminus[3], S2[3];
+  unsigned long N, count;
+  planeSums() : SSminus{0, 0, 0}, S2{0, 0, 0}, N(0), count(0) {}
+  void add(const planeSums& other) {
+    for (int d=X; d<=Z; d++) { SSminus[d] += other.SSminus[d]; S2[d] += other.S2[d]; }
+    N += other.N;
+    count += other.count;
+  }
+};
 
-	  if( M > 2 ) {
+planeSums pairwise_sum(const vector<planeSums>& sums, size_t begin, size_t end)
+{
+  if (end - begin == 1) return sums[begin];
+  const size_t middle((begin + end) / 2);
+  planeSums total(pairwise_sum(sums, begin, middle));
+  total.add(pairwise_sum(sums, middle, end));
+  return total;
+}
 
-	    // For each voxel
-	    //    calculate mean and standard deviation...
-	    double Sx = 0.0, SSx = 0.0;
+unsigned long total_sums(const vector<planeSums>& sums, double SSminus[3], double S2[3], unsigned long& N)
+{
+  const planeSums total(pairwise_sum(sums, 0, sums.size()));
+  for (int d=X; d<=Z; d++) { SSminus[d] = total.SSminus[d]; S2[d] = total.S2[d]; }
+  N = total.N;
+  return total.count;
+}
 
-	    for ( int t = 0; t < M; t++ ) {
-	      double R_it = R(x,y,z,t);
+// The terms of the sums at each voxel, kept for --orpv: those of SSminus and
+// S2 in each direction, and 1 where the voxel counts towards N
+struct voxelSums {
+  vector<double> SSminus[3], S2[3], N;
+  voxelSums(const int64_t nvox) {
+    for (int d=X; d<=Z; d++) { SSminus[d].assign(nvox, 0.0); S2[d].assign(nvox, 0.0); }
+    N.assign(nvox, 0.0);
+  }
+};
 
-	      Sx += R_it;
-	      SSx += Sqr(R_it);
-	    }
+// Calls f(z0,z1) for nthreads ranges of the nz planes at once
+template <class F>
+void for_each_slab(const int64_t nz, const int nthreads, F f)
+{
+  const int nslabs(std::max((int64_t) 1, std::min((int64_t) nthreads, nz)));
+  vector<std::thread> threads(nslabs-1); // + main thread makes nslabs
+  for (int s=0; s<nslabs-1; s++)
+    threads[s] = std::thread(f, (s*nz)/nslabs, ((s+1)*nz)/nslabs);
+  f(((nslabs-1)*nz)/nslabs, nz);
+  std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+}
 
-	    double mean = Sx / M;
-	    double sdsq = (SSx - (Sqr(Sx) / M)) / (M - 1) ;
+//////////////////////////////////////////////////////////////////////////////
+// Standardise the residual field (assuming gaussianity) and sum the products
+// of the standardised residuals of each voxel and its x, y and z predecessors.
+// Each masked row is visited once, taking the row and the rows before it in y
+// and z from every volume in turn, so that the inner loops run along
+// contiguous memory; the sums over t of each voxel's residuals, their squares
+// and their products with its predecessors are kept per row. With the mean
+// and sd of each voxel, and z=(R-mean)/sd,
+//   sum_t z_u z_v = (sum_t R_u R_v - M mean_u mean_v) / (sd_u sd_v)
+// so R itself is never rewritten. Voxels of constant residual are dropped
+// from the mask, as before. The sweep is shared among threads by z-slabs;
+// the products are kept per voxel until it ends, since a voxel's
+// predecessors may be in another slab. The terms of each voxel are also
+// added to local, if given.
+unsigned long smoothness_sums(volume<float>& mask, const volume4D<float>& R, const bool usez,
+			      double SSminus[3], double S2[3], unsigned long& N, const int nthreads,
+			      voxelSums* local=0)
+{
+  const int64_t nx(R.xsize()), ny(R.ysize()), nz(R.zsize()), nvox(nx*ny*nz);
+  const int M(R.tsize());
+  const bool standardised(M > 2);
+  // per voxel: mean, 1/sd, the sum over t of its squared standardised
+  // residual and the sums of its products with its predecessors
+  vector<double> mean(nvox, 0.0), scale(nvox, 1.0), SSz(nvox, 0.0);
+  vector<double> P[3] = {vector<double>(nvox, 0.0), vector<double>(nvox, 0.0), vector<double>(nvox, 0.0)};
+  vector<planeSums> sums(nz);
+  float* maskdata(mask.nsfbegin());
+
+  for_each_slab(nz, nthreads, [&](const int64_t z0, const int64_t z1) {
+    vector<double> Sx(nx), SSx(nx);
+    for (int64_t z=z0; z<z1; z++) {
+      for (int64_t y=0; y<ny; y++) {
+	const int64_t row(nx*(y + ny*z));
+	float* m(maskdata + row);
+	int64_t x0(0), x1(nx-1);
+	while (x0<=x1 && !(m[x0]>0.5)) x0++;
+	while (x1>=x0 && !(m[x1]>0.5)) x1--;
+	if (x0>x1) continue;
+	const bool pairY(y>0), pairZ(usez && z>0);
+	double *Px(&P[X][row]), *Py(&P[Y][row]), *Pz(&P[Z][row]);
+	std::fill(Sx.begin(), Sx.end(), 0.0);
+	std::fill(SSx.begin(), SSx.end(), 0.0);
+
+	for (int t=0; t<M; t++) {
+	  const float* r(R.fbegin(t) + row);
+	  for (int64_t x=x0; x<=x1; x++) {
+	    const double R_it(r[x]);
+	    Sx[x] += R_it;
+	    SSx[x] += R_it*R_it;
+	  }
+	  for (int64_t x=x0+1; x<=x1; x++) Px[x] += (double) r[x]*r[x-1];
+	  if (pairY) {
+	    const float* ry(r - nx);
+	    for (int64_t x=x0; x<=x1; x++) Py[x] += (double) r[x]*ry[x];
+	  }
+	  if (pairZ) {
+	    const float* rz(r - nx*ny);
+	    for (int64_t x=x0; x<=x1; x++) Pz[x] += (double) r[x]*rz[x];
+	  }
+	}
 
+	for (int64_t x=x0; x<=x1; x++) {
+	  if (!(m[x]>0.5)) continue;
+	  if (standardised) {
+	    const double sdsq((SSx[x] - Sqr(Sx[x]) / M) / (M - 1));
 	    if (sdsq<=0) {
 	      // trap for differences between mask and invalid data
-	      mask(x,y,z)=0;
-	      count--;
-	    } else {
-	      //    ... and use them to standardise to N(0, 1).
-	      for ( unsigned short t = 0; t < M; t++ ) {
-		R(x,y,z,t) = (R(x,y,z,t) - mean) / sqrt(sdsq);
-	      }
+	      m[x]=0;
+	      continue;
 	    }
+	    mean[row+x] = Sx[x] / M;
+	    scale[row+x] = 1.0 / sqrt(sdsq);
+	  }
+	  SSz[row+x] = Sqr(scale[row+x]) * (SSx[x] - M*Sqr(mean[row+x]));
+	  sums[z].count++;
+	}
+      }
+    }
+  });
+
+  // Sum over N the voxels whose predecessors are all in the mask
+  const float* m(maskdata);
+  for_each_slab(nz, nthreads, [&](const int64_t z0, const int64_t z1) {
+    for (int64_t z=std::max(z0, (int64_t) (usez ? 1 : 0)); z<z1; z++) {
+      planeSums& plane(sums[z]);
+      for (int64_t y=1; y<ny; y++) {
+	for (int64_t x=1, idx=nx*(y + ny*z) + 1; x<nx; x++, idx++) {
+	  if ( !(m[idx]>0.5) || !(m[idx-1]>0.5) || !(m[idx-nx]>0.5) || (usez && !(m[idx-nx*ny]>0.5)) ) continue;
+	  plane.N++;
+	  if (local) local->N[idx] = 1;
+	  const int64_t before[3] = {idx-1, idx-nx, idx-nx*ny};
+	  for (int d=X; d<=(usez ? Z : Y); d++) {
+	    const int64_t b(before[d]);
+	    const double SSminus_i(scale[idx]*scale[b] * (P[d][idx] - M*mean[idx]*mean[b]));
+	    const double S2_i(0.5 * (SSz[idx] + SSz[b]));
+	    plane.SSminus[d] += SSminus_i;
+	    plane.S2[d] += S2_i;
+	    if (local) { local->SSminus[d][idx] += SSminus_i; local->S2[d][idx] += S2_i; }
+	  }
+	}
+      }
+    }
+  });
+  return total_sums(sums, SSminus, S2, N);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// The same sums without holding the 4D image in memory: a first pass reads
+// it a volume at a time to find the mean and variance of each voxel, with
+// Welford's update, and a second reads it again, standardising each volume
+// as it arrives and adding up the products of the voxels that have all their
+// predecessors in the mask. Only the volume read is resident, as well as the
+// per-voxel means and scales. Each volume is shared among threads by z-slabs.
+// The terms of each voxel are also added to local, if given.
+unsigned long stream_smoothness_sums(volume<float>& mask, const string& filename, const bool usez,
+				     double SSminus[3], double S2[3], unsigned long& N, const int nthreads,
+				     voxelSums* local=0)
+{
+  const int64_t nx(mask.xsize()), ny(mask.ysize()), nz(mask.zsize()), nvox(nx*ny*nz);
+  volumeStream first(filename);
+  const int64_t M(first.nvolumes());
+  vector<double> mean(nvox, 0.0), scale(nvox, 1.0);
+  float* m(mask.nsfbegin());
+  vector<planeSums> sums(nz);
+  volume<float> R_t;
+
+  if (M > 2) {
+    vector<double> M2(nvox, 0.0);
+    for (int64_t t=1; first.read_next_volume(R_t); t++) {
+      const float* r(R_t.fbegin());
+      for_each_slab(nz, nthreads, [&](const int64_t z0, const int64_t z1) {
+	for (int64_t i=z0*nx*ny; i<z1*nx*ny; i++) {
+	  const double delta(r[i] - mean[i]);
+	  mean[i] += delta / t;
+	  M2[i] += delta * (r[i] - mean[i]);
+	}
+      });
+    }
+    for (int64_t i=0; i<nvox; i++) {
+      if (!(m[i]>0.5)) continue;
+      const double sdsq(M2[i] / (M - 1));
+      if (sdsq<=0) {
+	// trap for differences between mask and invalid data
+	m[i]=0;
+      } else {
+	scale[i] = 1.0 / sqrt(sdsq);
+      }
+    }
+  }
+
+  // the voxels whose predecessors are all in the mask, plane by plane
+  vector<int64_t> voxels;
+  vector<size_t> planeStart(nz+1, 0);
+  for (int64_t z=0; z<nz; z++) {
+    for (int64_t i=z*nx*ny; i<(z+1)*nx*ny; i++) sums[z].count += (m[i]>0.5);
+    for (int64_t y=1; y<ny && (z>0 || !usez); y++)
+      for (int64_t x=1, idx=nx*(y + ny*z) + 1; x<nx; x++, idx++)
+	if ( (m[idx]>0.5) && (m[idx-1]>0.5) && (m[idx-nx]>0.5) && ( (!usez) || (m[idx-nx*ny]>0.5) ) ) {
+	  voxels.push_back(idx);
+	  if (local) local->N[idx] = 1;
+	}
+    planeStart[z+1] = voxels.size();
+    sums[z].N = planeStart[z+1] - planeStart[z];
+  }
+
+  volumeStream second(filename);
+  while (second.read_next_volume(R_t)) {
+    const float* r(R_t.fbegin());
+    for_each_slab(nz, nthreads, [&](const int64_t z0, const int64_t z1) {
+      for (int64_t z=z0; z<z1; z++) {
+	planeSums& plane(sums[z]);
+	for (size_t n=planeStart[z]; n<planeStart[z+1]; n++) {
+	  const int64_t idx(voxels[n]), before[3] = {idx-1, idx-nx, idx-nx*ny};
+	  const double Z_it((r[idx] - mean[idx]) * scale[idx]);
+	  for (int d=X; d<=(usez ? Z : Y); d++) {
+	    const int64_t b(before[d]);
+	    const double Z_bt((r[b] - mean[b]) * scale[b]);
+	    const double SSminus_it(Z_it * Z_bt), S2_it(0.5 * (Sqr(Z_it) + Sqr(Z_bt)));
+	    plane.SSminus[d] += SSminus_it;
+	    plane.S2[d] += S2_it;
+	    if (local) { local->SSminus[d][idx] += SSminus_it; local->S2[d][idx] += S2_it; }
 	  }
 	}
       }
+    });
+  }
+  return total_sums(sums, SSminus, S2, N);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Replaces each value of v by its sum over the box of half-width w around
+// it, clipped to the image, as running sums along x, then y, then z, so that
+// the cost does not grow with w
+void box_sum(vector<double>& v, const int64_t nx, const int64_t ny, const int64_t nz,
+	     const int64_t w, const int nthreads)
+{
+  // one line of n values, stride apart, through a prefix sum
+  auto box_line = [w](double* line, const int64_t n, const int64_t stride, vector<double>& prefix) {
+    prefix[0] = 0;
+    for (int64_t i=0; i<n; i++) prefix[i+1] = prefix[i] + line[i*stride];
+    for (int64_t i=0; i<n; i++)
+      line[i*stride] = prefix[std::min(n, i+w+1)] - prefix[std::max((int64_t) 0, i-w)];
+  };
+  const int64_t nmax(std::max(nx, std::max(ny, nz)));
+  for_each_slab(nz, nthreads, [&](const int64_t z0, const int64_t z1) {
+    vector<double> prefix(nmax+1);
+    for (int64_t z=z0; z<z1; z++) {
+      for (int64_t y=0; y<ny; y++) box_line(&v[nx*(y + ny*z)], nx, 1, prefix);
+      for (int64_t x=0; x<nx; x++) box_line(&v[x + nx*ny*z], ny, nx, prefix);
     }
+  });
+  // the z lines are shared by y instead
+  for_each_slab(ny, nthreads, [&](const int64_t y0, const int64_t y1) {
+    vector<double> prefix(nmax+1);
+    for (int64_t y=y0; y<y1; y++)
+      for (int64_t x=0; x<nx; x++) box_line(&v[x + nx*y], nz, nx*ny, prefix);
+  });
+}
+
+// Resels per voxel, 1/(FWHMx FWHMy FWHMz) with the FWHM in voxels, from the
+// sums within the box of half-width w around each masked voxel, by the same
+// steps as the global estimate in main(). Windows without positive sums are
+// left at 0, as are those outside the mask.
+volume<float> resels_per_voxel(const volume<float>& mask, voxelSums& local, const bool usez,
+			       const int w, const int nthreads)
+{
+  const int64_t nx(mask.xsize()), ny(mask.ysize()), nz(mask.zsize());
+  const int ndims(usez ? 3 : 2);
+  for (int d=X; d<ndims; d++) {
+    box_sum(local.SSminus[d], nx, ny, nz, w, nthreads);
+    box_sum(local.S2[d], nx, ny, nz, w, nthreads);
   }
-  return count;
+  box_sum(local.N, nx, ny, nz, w, nthreads);
+
+  volume<float> rpv(mask);
+  rpv = 0;
+  float* out(rpv.nsfbegin());
+  const float* m(mask.fbegin());
+  for (int64_t idx=0; idx<nx*ny*nz; idx++) {
+    if ( !(m[idx]>0.5) || !(local.N[idx]>0) ) continue;
+    double resels(1.0);
+    bool flat(false);
+    for (int d=X; d<ndims && !flat; d++) {
+      double SSminus_i(local.SSminus[d][idx]);
+      const double S2_i(local.S2[d][idx]);
+      // constant or zero-filled windows have no smoothness to measure
+      flat = !(S2_i>0) || !(SSminus_i>0);
+      if (flat) continue;
+      if (SSminus_i>=0.99999999*S2_i) SSminus_i=0.99999*S2_i;  // for extreme smoothness
+      const double sigmasq(-1.0 / (4 * log(fabs(SSminus_i/S2_i))));
+      resels *= sqrt(8 * log(2) * sigmasq);
+    }
+    if (!flat) out[idx] = 1.0 / resels;
+  }
+  return rpv;
 }
 
 
@@ -158,6 +438,10 @@ int main(int argc, char **argv) {
   options.add(maskname);
   options.add(residname);
   options.add(zstatname);
+  options.add(streaming);
+  options.add(numthreads);
+  options.add(rpvname);
+  options.add(rpvwindow);
 
   options.parse_command_line(argc, argv);
 
@@ -168,6 +452,15 @@ int main(int argc, char **argv) {
     exit(EXIT_SUCCESS);
   }
 
+  if (numthreads.value() < 1) {
+    cerr << "The number of threads must be at least 1" << endl;
+    exit(EXIT_FAILURE);
+  }
+  if (rpvwindow.value() < 0) {
+    cerr << "The --rpvwindow half-width must not be negative" << endl;
+    exit(EXIT_FAILURE);
+  }
+
   if( !((zstatname.set() && residname.unset()) || (residname.set() && zstatname.unset())) ||
       (zstatname.set() && (residname.set() || dof.set())) ||
       (residname.set() && dof.unset()) ||
@@ -191,6 +484,7 @@ int main(int argc, char **argv) {
     cout << "maskname = " << maskname.value() << endl;
     cout << "residname = " << residname.value() << endl;
     cout << "zstatname = " << zstatname.value() << endl;
+    cout << "threads = " << numthreads.value() << endl;
   }
 
   // Read the AVW mask image (single volume)
@@ -212,24 +506,21 @@ int main(int argc, char **argv) {
   if(verbose.value()) cerr << "done" << endl;
 
 
+  // only the header when streaming, which leaves the data unread
   volume4D<float> R;
-  read_volume4D(R,datafilename);
-  if (verbose.value()) print_volume_info(R,"Data (residuals/zstat)");
+  if (streaming.value()) {
+    read_volume4D_hdr_only(R,datafilename);
+  } else {
+    read_volume4D(R,datafilename);
+    if (verbose.value()) print_volume_info(R,"Data (residuals/zstat)");
+  }
 
-  if (!samesize(R[0],mask)) {
+  if (!samesize(R,mask,3)) {
     cerr << "Mask and Data (residuals/zstat) volumes MUST be the same size!"
 	 << endl;
     exit(EXIT_FAILURE);
   }
 
-  if(verbose.value()) cerr << "Standardising....";
-  unsigned long mask_volume = standardise(mask, R);
-  if(verbose.value()) cerr << "done" << endl;
-
-  if(verbose.value()) cerr << "Masked-in voxels = " << mask_volume << endl;
-
-  unsigned long N = 0;
-
   // MJ additions to make it cope with 2D images
   bool usez = true;
   if (R.zsize() <= 1) { usez = false; }
@@ -239,33 +530,26 @@ int main(int argc, char **argv) {
 
   // Estimate the smoothness of the normalised residual field
   // see TR00DF1 for mathematical description of the algorithm.
-  enum {X = 0, Y, Z};
   double SSminus[3] = {0, 0, 0}, S2[3] = {0, 0, 0};
+  unsigned long N = 0;
 
-  int zstart=1;
-  if (!usez) zstart=0;
-  for ( unsigned short z = zstart; z < R.zsize() ; z++ )
-    for ( unsigned short y = 1; y < R.ysize() ; y++ )
-      for ( unsigned short x = 1; x < R.xsize() ; x++ )
-	// Sum over N
-	if( (mask(x, y, z)>0.5) &&
-	    (mask(x-1, y, z)>0.5) &&
-	    (mask(x, y-1, z)>0.5) &&
-	    ( (!usez) || (mask(x, y, z-1)>0.5) ) ) {
-
-	  N++;
-
-	  for ( unsigned short t = 0; t < R.tsize(); t++ ) {
-	    // Sum over M
-	    SSminus[X] += R(x, y, z, t) * R(x-1, y, z, t);
-	    SSminus[Y] += R(x, y, z, t) * R(x, y-1, z, t);
-	    if (usez) SSminus[Z] += R(x, y, z, t) * R(x, y, z-1, t);
-
-	    S2[X] += 0.5 * (Sqr(R(x, y, z, t)) + Sqr(R(x-1, y, z, t)));
-	    S2[Y] += 0.5 * (Sqr(R(x, y, z, t)) + Sqr(R(x, y-1, z, t)));
-	    if (usez) S2[Z] += 0.5 * (Sqr(R(x, y, z, t)) + Sqr(R(x, y, z-1, t)));
-	  }
-	}
+  std::unique_ptr<voxelSums> local;
+  if (rpvname.set()) local.reset(new voxelSums(mask.nvoxels()));
+
+  if(verbose.value()) cerr << "Standardising....";
+  unsigned long mask_volume;
+  if (streaming.value()) mask_volume = stream_smoothness_sums(mask, datafilename, usez, SSminus, S2, N, numthreads.value(), local.get());
+  else mask_volume = smoothness_sums(mask, R, usez, SSminus, S2, N, numthreads.value(), local.get());
+  if(verbose.value()) cerr << "done" << endl;
+
+  if (local) {
+    if(verbose.value()) cerr << "Writing resels per voxel....";
+    save_volume(resels_per_voxel(mask, *local, usez, rpvwindow.value(), numthreads.value()), rpvname.value());
+    local.reset();
+    if(verbose.value()) cerr << "done" << endl;
+  }
+
+  if(verbose.value()) cerr << "Masked-in voxels = " << mask_volume << endl;
 
   double norm = 1.0/(double) N;
   double v = dof.value();	// v - degrees of freedom (nu)
@@ -920,3 +920,255 @@ std::vector<unsigned int> rows_per_thread(unsigned int nrows,
 }
 
 } // End namespace RGT_UTILS
+
+namespace N2N_UTILS { // Batched NewimageCoord2NewimageCoord utilities
+
+InvWarpLookup::InvWarpLookup(const NEWIMAGE::volume4D<float>& warp,
+			     float                            pxdim,
+			     float                            pydim,
+			     float                            pzdim,
+			     float                            pmaxdim)
+  : nx(warp.xsize()), ny(warp.ysize()), nz(warp.zsize()), xdim(pxdim), ydim(pydim), zdim(pzdim), maxdim(pmaxdim),
+    px(nx*ny*nz), py(nx*ny*nz), pz(nx*ny*nz), cell(1), lox(0), loy(0), loz(0), gx(0), gy(0), gz(0)
+{
+  // Same (float) arithmetic as inv_coord, so that the tests there give identical results
+  int64_t v=0;
+  for (int z2=0; z2<nz; z2++) {
+    for (int y2=0; y2<ny; y2++) {
+      for (int x2=0; x2<nx; x2++, v++) {
+	px[v]=(warp(x2,y2,z2,0)+x2*warp.xdim())/xdim;
+	py[v]=(warp(x2,y2,z2,1)+y2*warp.ydim())/ydim;
+	pz[v]=(warp(x2,y2,z2,2)+z2*warp.zdim())/zdim;
+      }
+    }
+  }
+  // Bin the finite positions on a grid of cells that are grown until
+  // the grid is not much larger than the field itself
+  bool first=true;
+  int64_t hix=0, hiy=0, hiz=0;
+  for (v=0; v<nx*ny*nz; v++) {
+    if (!std::isfinite(px[v]) || !std::isfinite(py[v]) || !std::isfinite(pz[v])) continue;
+    int64_t fx=static_cast<int64_t>(std::floor(px[v])), fy=static_cast<int64_t>(std::floor(py[v])), fz=static_cast<int64_t>(std::floor(pz[v]));
+    if (first) { lox=hix=fx; loy=hiy=fy; loz=hiz=fz; first=false; }
+    lox=std::min(lox,fx); hix=std::max(hix,fx);
+    loy=std::min(loy,fy); hiy=std::max(hiy,fy);
+    loz=std::min(loz,fz); hiz=std::max(hiz,fz);
+  }
+  if (first) return;  // Nothing to bin
+  for (;; cell*=2) {
+    gx=(hix-lox)/cell+1; gy=(hiy-loy)/cell+1; gz=(hiz-loz)/cell+1;
+    if (double(gx)*double(gy)*double(gz) <= 2.0*double(nx*ny*nz)+64.0) break;
+  }
+  std::vector<int64_t> cellOf(nx*ny*nz,-1);
+  cellStart.assign(gx*gy*gz+1,0);
+  for (v=0; v<nx*ny*nz; v++) {
+    if (!std::isfinite(px[v]) || !std::isfinite(py[v]) || !std::isfinite(pz[v])) continue;
+    int64_t cx=(static_cast<int64_t>(std::floor(px[v]))-lox)/cell;
+    int64_t cy=(static_cast<int64_t>(std::floor(py[v]))-loy)/cell;
+    int64_t cz=(static_cast<int64_t>(std::floor(pz[v]))-loz)/cell;
+    cellOf[v]=cx+gx*(cy+gy*cz);
+    cellStart[cellOf[v]+1]++;
+  }
+  for (int64_t c=0; c<gx*gy*gz; c++) cellStart[c+1]+=cellStart[c];
+  cellVoxels.resize(cellStart.back());
+  std::vector<int64_t> fill(cellStart.begin(),cellStart.end()-1);
+  for (v=0; v<nx*ny*nz; v++) if (cellOf[v]>=0) cellVoxels[fill[cellOf[v]]++]=v;
+}
+
+void InvWarpLookup::candidates(double x, double y, double z, double dist, std::vector<int64_t>& voxels) const
+{
+  voxels.clear();
+  if (cellStart.empty() || !std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z)) return;
+  // One extra cell on either side guards against rounding in the positions
+  double lo[3] = {std::floor((x-dist-lox)/cell)-1, std::floor((y-dist-loy)/cell)-1, std::floor((z-dist-loz)/cell)-1};
+  double hi[3] = {std::floor((x+dist-lox)/cell)+1, std::floor((y+dist-loy)/cell)+1, std::floor((z+dist-loz)/cell)+1};
+  double gsz[3] = {double(gx), double(gy), double(gz)};
+  for (int d=0; d<3; d++) {
+    if (hi[d]<0 || lo[d]>gsz[d]-1) return;
+    lo[d]=std::max(lo[d],0.0); hi[d]=std::min(hi[d],gsz[d]-1);
+  }
+  for (int64_t cz=int64_t(lo[2]); cz<=int64_t(hi[2]); cz++) {
+    for (int64_t cy=int64_t(lo[1]); cy<=int64_t(hi[1]); cy++) {
+      for (int64_t cx=int64_t(lo[0]); cx<=int64_t(hi[0]); cx++) {
+	int64_t c=cx+gx*(cy+gy*cz);
+	voxels.insert(voxels.end(),cellVoxels.begin()+cellStart[c],cellVoxels.begin()+cellStart[c+1]);
+      }
+    }
+  }
+  std::sort(voxels.begin(),voxels.end());
+}
+
+std::vector<uint64_t> points_per_thread(uint64_t npoints,
+					unsigned int nthr)
+{
+  double ppt = static_cast<double>(npoints) / static_cast<double>(nthr);
+  std::vector<uint64_t> np(nthr+1,0);
+  for (unsigned int i=1; i<nthr; i++) np[i] = static_cast<uint64_t>(std::floor(i*ppt));
+  np[nthr] = npoints;
+  return(np);
+}
+
+// Top three rows of a 4x4 affine, and their application to one point (in may be out)
+static void affine_rows(const NEWMAT::Matrix& A, double a[3][4])
+{
+  for (int i=0; i<3; i++) for (int j=0; j<4; j++) a[i][j] = A(i+1,j+1);
+}
+
+static inline void affine_point(const double a[3][4], const double *in, double *out)
+{
+  double x=in[0], y=in[1], z=in[2];
+  out[0] = a[0][0]*x + a[0][1]*y + a[0][2]*z + a[0][3];
+  out[1] = a[1][0]*x + a[1][1]*y + a[1][2]*z + a[1][3];
+  out[2] = a[2][0]*x + a[2][1]*y + a[2][2]*z + a[2][3];
+}
+
+void affine_points(uint64_t              first,
+		   uint64_t              last,
+		   const NEWMAT::Matrix& A,
+		   const double          *in,
+		   double                *out)
+{
+  double a[3][4];
+  affine_rows(A,a);
+  for (uint64_t p=first; p<last; p++) affine_point(a,in+3*p,out+3*p);
+}
+
+void affine_points(const NEWMAT::Matrix& A,
+		   const double          *in,
+		   double                *out,
+		   uint64_t              npoints,
+		   unsigned int          nthr)
+{
+  std::vector<uint64_t> np = points_per_thread(npoints,nthr);
+  std::vector<std::thread> threads(nthr-1); // + main thread makes nthr
+  for (unsigned int i=0; i<nthr-1; i++) {
+    threads[i] = std::thread(static_cast<void (*)(uint64_t,uint64_t,const NEWMAT::Matrix&,const double*,double*)>(affine_points),
+			     np[i],np[i+1],std::cref(A),in,out);
+  }
+  affine_points(np[nthr-1],np[nthr],A,in,out);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
+}
+
+void displace_points(uint64_t                         first,
+		     uint64_t                         last,
+		     const NEWMAT::Matrix&            iW,
+		     const NEWIMAGE::volume4D<float>& warps,
+		     const double                     *in,
+		     double                           *out)
+{
+  // Private copies of the displacement fields, as out-of-bounds look-ups are not thread safe
+  std::vector<NEWIMAGE::volume<float> > d;
+  for (int i=0; i<3; i++) {
+    d.push_back(warps[i]);
+    if (warps.getextrapolationmethod()!=NEWIMAGE::periodic) d[i].setextrapolationmethod(NEWIMAGE::extraslice);
+  }
+  double iw[3][4];
+  affine_rows(iW,iw);
+  for (uint64_t p=first; p<last; p++) {
+    double vd[3];
+    affine_point(iw,in+3*p,vd);
+    for (int i=0; i<3; i++) out[3*p+i] = in[3*p+i] + d[i].interpolate(vd[0],vd[1],vd[2]);
+  }
+}
+
+void inverse_points(uint64_t                         first,
+		    uint64_t                         last,
+		    const InvWarpLookup&             lookup,
+		    const NEWIMAGE::volume4D<float>& warps,
+		    const NEWMAT::Matrix&            LtL,
+		    const double                     *in,
+		    double                           *out)
+{
+  const int N=5;
+  const int N_2=(int)(N/2);
+  const int centre=1+N_2+N*(N_2+N*N_2);  // Column of the point itself
+  std::vector<int64_t> voxels, rows;
+  std::vector<float> rdx, rdy, rdz;
+  std::vector<NEWIMAGE::volume<float> > d;  // Copied on first use, for the nearest-voxel fallback
+  for (uint64_t p=first; p<last; p++) {
+    const double c1=in[3*p], c2=in[3*p+1], c3=in[3*p+2];
+    // The voxels mapping into the neighbourhood of the point, in raster order
+    lookup.candidates(c1,c2,c3,N_2,voxels);
+    rows.clear(); rdx.clear(); rdy.clear(); rdz.clear();
+    for (unsigned int k=0; k<voxels.size(); k++) {
+      float dx=lookup.px[voxels[k]]-c1, dy=lookup.py[voxels[k]]-c2, dz=lookup.pz[voxels[k]]-c3;
+      if ((std::fabs(dx)<N_2) && (std::fabs(dy)<N_2) && (std::fabs(dz)<N_2)) {
+	rows.push_back(voxels[k]); rdx.push_back(dx); rdy.push_back(dy); rdz.push_back(dz);
+      }
+    }
+    if (rows.size()>8) {
+      int nrows=rows.size();
+      NEWMAT::Matrix M(nrows,N*N*N);
+      M=0.0;
+      NEWMAT::Matrix coordlist(nrows,3);
+      for (int r=0; r<nrows; r++) {
+	coordlist(r+1,1)=rows[r] % lookup.nx;
+	coordlist(r+1,2)=(rows[r] / lookup.nx) % lookup.ny;
+	coordlist(r+1,3)=rows[r] / (lookup.nx*lookup.ny);
+	for (int z1=-N_2; z1<=N_2; z1++) {
+	  for (int y1=-N_2; y1<=N_2; y1++) {
+	    for (int x1=-N_2; x1<=N_2; x1++) {
+	      if ((std::fabs(rdx[r]-x1)<1.0) && (std::fabs(rdy[r]-y1)<1.0) && (std::fabs(rdz[r]-z1)<1.0)) {
+		M(r+1,1+(x1+N_2)+N*((y1+N_2)+N*(z1+N_2))) = (1.0-std::fabs(rdx[r]-x1))*(1.0-std::fabs(rdy[r]-y1))*(1.0-std::fabs(rdz[r]-z1));
+	      }
+	    }
+	  }
+	}
+      }
+      // Only the row of the solution for the point itself is needed
+      NEWMAT::CroutMatrix X = M.t()*M + LtL;
+      NEWMAT::Matrix sol = X.i().Row(centre)*M.t()*coordlist;
+      out[3*p]=sol(1,1); out[3*p+1]=sol(1,2); out[3*p+2]=sol(1,3);
+    }
+    else {
+      // Too few voxels map nearby, so use the relative warp of the nearest one (searching all of them)
+      float mindist=lookup.maxdim*lookup.maxdim;
+      float minptx=-1, minpty=-1, minptz=-1;
+      int64_t v=0;
+      for (int z2=0; z2<lookup.nz; z2++) {
+	for (int y2=0; y2<lookup.ny; y2++) {
+	  for (int x2=0; x2<lookup.nx; x2++, v++) {
+	    float dx=lookup.px[v]-c1, dy=lookup.py[v]-c2, dz=lookup.pz[v]-c3;
+	    float dist=dx*dx+dy*dy+dz*dz;
+	    if (dist<mindist) { mindist=dist; minptx=x2; minpty=y2; minptz=z2; }
+	  }
+	}
+      }
+      if (d.empty()) for (int i=0; i<3; i++) d.push_back(warps[i]);
+      out[3*p]   = (d[0].interpolate(minptx,minpty,minptz) + c1*lookup.xdim)/warps.xdim();
+      out[3*p+1] = (d[1].interpolate(minptx,minpty,minptz) + c2*lookup.ydim)/warps.ydim();
+      out[3*p+2] = (d[2].interpolate(minptx,minpty,minptz) + c3*lookup.zdim)/warps.zdim();
+    }
+  }
+}
+
+NEWMAT::Matrix inv_coord_regularisation(float lambda)
+{
+  // Same isotropic second-difference operator as built by inv_coord
+  const int N=5;
+  const int ncols=N*N*N;
+  NEWMAT::Matrix L;
+  for (int z=0; z<N; z++) {
+    for (int y=0; y<N; y++) {
+      for (int x=0; x<N; x++) {
+	int c=1+x+N*(y+N*z);
+	if ((x>0) && (x<N-1)) {
+	  MISCMATHS::addrow(L,ncols);
+	  L(L.Nrows(),c)=2; L(L.Nrows(),c-1)=-1; L(L.Nrows(),c+1)=-1;
+	}
+	if ((y>0) && (y<N-1)) {
+	  MISCMATHS::addrow(L,ncols);
+	  L(L.Nrows(),c)=2; L(L.Nrows(),c-N)=-1; L(L.Nrows(),c+N)=-1;
+	}
+	if ((z>0) && (z<N-1)) {
+	  MISCMATHS::addrow(L,ncols);
+	  L(L.Nrows(),c)=2; L(L.Nrows(),c-N*N)=-1; L(L.Nrows(),c+N*N)=-1;
+	}
+      }
+    }
+  }
+  NEWMAT::Matrix LtL = lambda*L.t()*L;
+  return(LtL);
+}
+
+} // End namespace N2N_UTILS
@@ -129,6 +129,74 @@ void set_sqform(// Input
 
 } // End namespace RGT_UTILS
 
+namespace N2N_UTILS { // Batched NewimageCoord2NewimageCoord utilities
+
+/// Where every voxel of a (relative, mm) warp-field maps to, in voxel
+/// coordinates of the space it warps. The voxels are binned on a grid
+/// so that those mapping close to a given point can be found without
+/// visiting the whole field, which is what makes inverting the field
+/// at many points affordable.
+class InvWarpLookup
+{
+public:
+  InvWarpLookup(const NEWIMAGE::volume4D<float>& warp,
+		float                            xdim,    // Voxel size of space warped to
+		float                            ydim,
+		float                            zdim,
+		float                            maxdim); // Largest of its maxx, maxy, maxz
+  /// Raster indices (ascending) of the warp voxels that may map within dist voxels of (x,y,z)
+  void candidates(double x, double y, double z, double dist, std::vector<int64_t>& voxels) const;
+  int64_t nx, ny, nz;
+  float xdim, ydim, zdim, maxdim;
+  std::vector<float> px, py, pz;   // Mapped position of every warp voxel
+private:
+  int64_t cell;                    // Cell size in voxels
+  int64_t lox, loy, loz;           // Grid origin in voxels
+  int64_t gx, gy, gz;              // Grid size in cells
+  std::vector<int64_t> cellStart, cellVoxels;
+};
+
+/// Returns a vector where v[i] and v[i+1] denotes the first and
+/// (on past the) last point to be processed by the ith thread
+std::vector<uint64_t> points_per_thread(uint64_t npoints,
+					unsigned int nthr);
+
+/// out = A*in for points first to last-1 (3 values per point)
+void affine_points(uint64_t              first,
+		   uint64_t              last,
+		   const NEWMAT::Matrix& A,
+		   const double          *in,
+		   double                *out);
+
+/// out = in + d(iW*in) where d is the displacement given by warps and in is in mm
+void displace_points(uint64_t                         first,
+		     uint64_t                         last,
+		     const NEWMAT::Matrix&            iW,
+		     const NEWIMAGE::volume4D<float>& warps,
+		     const double                     *in,
+		     double                           *out);
+
+/// out = inverse of the warps at in (voxel coordinates), as per inv_coord
+void inverse_points(uint64_t                         first,
+		    uint64_t                         last,
+		    const InvWarpLookup&             lookup,
+		    const NEWIMAGE::volume4D<float>& warps,
+		    const NEWMAT::Matrix&            LtL,    // lambda*L'*L, L is the regularisation matrix
+		    const double                     *in,
+		    double                           *out);
+
+/// affine_points divided between nthr threads
+void affine_points(const NEWMAT::Matrix& A,
+		   const double          *in,
+		   double                *out,
+		   uint64_t              npoints,
+		   unsigned int          nthr);
+
+/// Regularisation term lambda*L'*L of inv_coord
+NEWMAT::Matrix inv_coord_regularisation(float lambda);
+
+} // End namespace N2N_UTILS
+
 namespace NEWIMAGE {
 
 class WarpFnsException: public std::exception
@@ -333,6 +401,66 @@ NEWMAT::ReturnMatrix NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M1
                                                  const volume<S>&             destvol,
                                                  const NEWMAT::ColumnVector&  srccoord);
 
+//
+// Batched versions of the above. These transform npoints coordinates
+// stored contiguously as x1 y1 z1 x2 y2 z2 ... in srccoords and write
+// them in the same layout to destcoords (which may be srccoords). The
+// matrix products and warp-field set-up are done once for all points,
+// which are then divided between nthr threads.
+//
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr=Utilities::NoOfThreads(1));
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr=Utilities::NoOfThreads(1));
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const NEWMAT::Matrix&        M,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr=Utilities::NoOfThreads(1));
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M,
+                                 const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr=Utilities::NoOfThreads(1));
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M1,
+                                 const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const NEWMAT::Matrix&        M2,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr=Utilities::NoOfThreads(1));
+
 //
 // Internal function providing functionality for
 // all the overloaded functions above.
@@ -346,6 +474,18 @@ int raw_newimagecoord2newimagecoord(const NEWMAT::Matrix         *M1,
                                     const volume<S>&             trgt,
                                     NEWMAT::ColumnVector&        coord);
 
+template <class D, class S>
+void raw_newimagecoord2newimagecoord(const NEWMAT::Matrix         *M1,
+                                     const volume4D<float>        *warps,
+                                     bool                         inv_flag,
+                                     const NEWMAT::Matrix         *M2,
+                                     const volume<D>&             src,
+                                     const volume<S>&             trgt,
+                                     const double                 *srccoords,
+                                     double                       *destcoords,
+                                     uint64_t                     npoints,
+                                     Utilities::NoOfThreads       nthr);
+
 //
 // Function to calculate the inverse lookup for a single coordinate
 // Uses newimage voxel coordinates everywhere and takes relative, mm warps
@@ -355,6 +495,20 @@ NEWMAT::ColumnVector inv_coord(const volume4D<float>&      warp,
                                const volume<T>&            srcvol,
                                const NEWMAT::ColumnVector& coord);
 
+//
+// Inverse lookup for npoints coordinates (x1 y1 z1 x2 y2 z2 ...) at once.
+// Gives the same result as the function above for every point, but maps
+// the warp-field only once and then visits only the voxels mapping close
+// to each point.
+//
+template <class T>
+void inv_coord(const volume4D<float>&      warp,
+               const volume<T>&            srcvol,
+               const double                *coords,
+               double                      *newcoords,
+               uint64_t                    npoints,
+               Utilities::NoOfThreads      nthr=Utilities::NoOfThreads(1));
+
 
 //////////////////////////////////////////////////////////////////////////
 //
@@ -676,6 +830,157 @@ NEWMAT::ColumnVector inv_coord(const volume4D<float>&      warp,
   return newcoord;
 }
 
+//
+// Batched versions of NewimageCoord2NewimageCoord
+//
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr)
+{
+  if (M.Nrows()!=4 || M.Ncols()!=4) imthrow("NewimageCoord2NewimageCoord: M must be a 4x4 matrix",11);
+  raw_newimagecoord2newimagecoord(&M,0,false,0,srcvol,destvol,srccoords,destcoords,npoints,nthr);
+}
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr)
+{
+  if (warps.tsize() != 3) imthrow("NewimageCoord2NewimageCoord: warps must be a 4D volume with three points in fourth dimension",11);
+  if (warps.nvoxels() <= 0) imthrow("NewimageCoord2NewimageCoord: warps must have a non-zero size",11);
+  raw_newimagecoord2newimagecoord(0,&warps,inv_flag,0,srcvol,destvol,srccoords,destcoords,npoints,nthr);
+}
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const NEWMAT::Matrix&        M,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr)
+{
+  if (M.Nrows()!=4 || M.Ncols()!=4) imthrow("NewimageCoord2NewimageCoord: M must be a 4x4 matrix",11);
+  if (warps.tsize() != 3) imthrow("NewimageCoord2NewimageCoord: warps must be a 4D volume with three points in fourth dimension",11);
+  if (warps.nvoxels() <= 0) imthrow("NewimageCoord2NewimageCoord: warps must have a non-zero size",11);
+  raw_newimagecoord2newimagecoord(0,&warps,inv_flag,&M,srcvol,destvol,srccoords,destcoords,npoints,nthr);
+}
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M,
+                                 const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr)
+{
+  if (M.Nrows()!=4 || M.Ncols()!=4) imthrow("NewimageCoord2NewimageCoord: M must be a 4x4 matrix",11);
+  if (warps.tsize() != 3) imthrow("NewimageCoord2NewimageCoord: warps must be a 4D volume with three points in fourth dimension",11);
+  if (warps.nvoxels() <= 0) imthrow("NewimageCoord2NewimageCoord: warps must have a non-zero size",11);
+  raw_newimagecoord2newimagecoord(&M,&warps,inv_flag,0,srcvol,destvol,srccoords,destcoords,npoints,nthr);
+}
+
+template <class D, class S>
+void NewimageCoord2NewimageCoord(const NEWMAT::Matrix&        M1,
+                                 const volume4D<float>&       warps,
+                                 bool                         inv_flag,
+                                 const NEWMAT::Matrix&        M2,
+                                 const volume<D>&             srcvol,
+                                 const volume<S>&             destvol,
+                                 const double                 *srccoords,
+                                 double                       *destcoords,
+                                 uint64_t                     npoints,
+                                 Utilities::NoOfThreads       nthr)
+{
+  if (M1.Nrows()!=4 || M1.Ncols()!=4) imthrow("NewimageCoord2NewimageCoord: M1 must be a 4x4 matrix",11);
+  if (M2.Nrows()!=4 || M2.Ncols()!=4) imthrow("NewimageCoord2NewimageCoord: M2 must be a 4x4 matrix",11);
+  if (warps.tsize() != 3) imthrow("NewimageCoord2NewimageCoord: warps must be a 4D volume with three points in fourth dimension",11);
+  if (warps.nvoxels() <= 0) imthrow("NewimageCoord2NewimageCoord: warps must have a non-zero size",11);
+  raw_newimagecoord2newimagecoord(&M1,&warps,inv_flag,&M2,srcvol,destvol,srccoords,destcoords,npoints,nthr);
+}
+
+template <class D, class S>
+void raw_newimagecoord2newimagecoord(const NEWMAT::Matrix         *M1,
+                                     const volume4D<float>        *warps,
+                                     bool                         inv_flag,
+                                     const NEWMAT::Matrix         *M2,
+                                     const volume<D>&             src,
+                                     const volume<S>&             trgt,
+                                     const double                 *srccoords,
+                                     double                       *destcoords,
+                                     uint64_t                     npoints,
+                                     Utilities::NoOfThreads       nthr)
+{
+  if (npoints==0) return;
+  //
+  // The steps are those of the single-point version, and the matrices are
+  // applied one at a time in the same order so that the results are identical.
+  //
+  unsigned int nt = static_cast<unsigned int>(std::max<int64_t>(1,std::min<int64_t>(nthr._n,npoints)));
+  N2N_UTILS::affine_points(src.sampling_mat(),srccoords,destcoords,npoints,nt);
+  if (M1) N2N_UTILS::affine_points(*M1,destcoords,destcoords,npoints,nt);
+  if (warps) {
+    if (inv_flag) {
+      // Into voxel-space of the warps, invert them there and back to mm
+      N2N_UTILS::affine_points(warps->sampling_mat().i(),destcoords,destcoords,npoints,nt);
+      inv_coord(*warps,*warps,destcoords,destcoords,npoints,Utilities::NoOfThreads(nt));
+      N2N_UTILS::affine_points(warps->sampling_mat(),destcoords,destcoords,npoints,nt);
+    }
+    else {
+      NEWMAT::Matrix iW = warps->sampling_mat().i();
+      std::vector<uint64_t> np = N2N_UTILS::points_per_thread(npoints,nt);
+      std::vector<std::thread> threads(nt-1); // + main thread makes nt
+      for (unsigned int i=0; i<nt-1; i++) {
+	threads[i] = std::thread(N2N_UTILS::displace_points,np[i],np[i+1],std::cref(iW),std::cref(*warps),destcoords,destcoords);
+      }
+      N2N_UTILS::displace_points(np[nt-1],np[nt],iW,*warps,destcoords,destcoords);
+      std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
+    }
+  }
+  if (M2) N2N_UTILS::affine_points(*M2,destcoords,destcoords,npoints,nt);
+  N2N_UTILS::affine_points(trgt.sampling_mat().i(),destcoords,destcoords,npoints,nt);
+}
+
+template <class T>
+void inv_coord(const volume4D<float>&      warp,
+               const volume<T>&            srcvol,
+               const double                *coords,
+               double                      *newcoords,
+               uint64_t                    npoints,
+               Utilities::NoOfThreads      nthr)
+{
+  if (npoints==0) return;
+  // Set-up shared by all points
+  N2N_UTILS::InvWarpLookup lookup(warp,srcvol.xdim(),srcvol.ydim(),srcvol.zdim(),
+				  MISCMATHS::Max(srcvol.maxx(),MISCMATHS::Max(srcvol.maxy(),srcvol.maxz())));
+  NEWMAT::Matrix LtL = N2N_UTILS::inv_coord_regularisation(0.5);  // 0.5 is the default in invwarp.cc
+
+  unsigned int nt = static_cast<unsigned int>(std::max<int64_t>(1,std::min<int64_t>(nthr._n,npoints)));
+  std::vector<uint64_t> np = N2N_UTILS::points_per_thread(npoints,nt);
+  std::vector<std::thread> threads(nt-1); // + main thread makes nt
+  for (unsigned int i=0; i<nt-1; i++) {
+    threads[i] = std::thread(N2N_UTILS::inverse_points,np[i],np[i+1],std::cref(lookup),std::cref(warp),std::cref(LtL),
+			     coords,newcoords);
+  }
+  N2N_UTILS::inverse_points(np[nt-1],np[nt],lookup,warp,LtL,coords,newcoords);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
+}
+
   ///////////////////////////////////////////////////////////////////////////
   // IMAGE PROCESSING ROUTINES
   ///////////////////////////////////////////////////////////////////////////